@@ -7,18 +7,48 @@
 
   Key features (designed to be unique and useful for a company demo):
   - Uses ESP32 with MFRC522 RFID reader
-  - Stores user profiles as UTF-8 JSON files in SPIFFS (/users/<UID>.json)
-  - Logs attendance to CSV on SPIFFS or optional SD card using UTF-8 with BOM
-  - Provides a lightweight async web UI (ESPAsyncWebServer) to add/edit users with Unicode names
+  - Stores user profiles as UTF-8 JSON files on flash (/users/<id>.json), each user with
+    any number of cards (badge, phone tag, replacement cards)
+  - Logs attendance to CSV on flash using UTF-8 with BOM, optionally mirrored to an SD card
+    by a background task (never blocks a scan; catches up after the card is reinserted)
+  - Tamper-evident log: a SHA-256 chain over every flushed block (/attendance.chain), with
+    signed chain heads at /api/log/chain and tools/verify_log_chain.py to check a download
+  - The log on flash is encrypted at rest (AES-128-CTR, a page per flush, key in NVS) and
+    decrypted as it is downloaded from /files/attendance.csv
+  - Provides a lightweight async web UI (ESPAsyncWebServer) to add/edit users with Unicode names;
+    its flash reads and writes run on a storage worker task, off the network task
   - Sends websocket messages to web clients on scans (UTF-8 safe)
+  - Optional weekly access schedules per user and group, with holidays, plus group/role
+    door permissions (/access.json)
+  - Live per-zone occupancy and optional anti-passback, with roll call over /api/occupancy
+  - Per-user daily first-in/last-out/presence summaries over /api/reports/daily
+  - Per-user scan history from an index over the log (/api/users/history)
+  - Versioned card revocation list, pushed as deltas and checked before any user lookup
+  - Visitor passes that expire on their own ("expires" on the user)
+  - Accent- and case-insensitive typeahead search over user names (/api/users/search)
+  - User listings and exports in language-friendly order from precomputed sort keys
+  - Scan pipeline (reader, user index, feedback, log sinks) composed from policy types at
+    compile time, so each firmware variant gets its own fully inlined scan path
+  - Card processing on its own task and core, away from Wi-Fi and the web server, with
+    scan-to-feedback latency histograms and an optional synthetic probe to measure jitter
+  - Admission control: web requests are shed with 503, lowest priority first, when the storage
+    queue, free heap or flash write time cross limits, so the scan path keeps its resources
+  - Per-client token-bucket rate limits on HTTP routes and websocket connections/messages
+  - Login tokens (HMAC-signed, viewer or admin) for the web API and websocket; recently
+    verified tokens are cached, so polling dashboards cost no HMAC per request
+  - Memory governor: as the heap tightens the web side degrades step by step (fewer and
+    leaner websocket pushes, paused downloads, then no web at all) while scans keep working
   - Clear, modular, well-commented single-file code for demonstration and easy extension
 
   Notes / Requirements:
-  - Libraries: MFRC522, SPIFFS (built-in for ESP32 core), SPI, Wire, WiFi, AsyncTCP,
+  - Libraries: MFRC522, SPIFFS / LittleFS (built-in for ESP32 core), SPI, Wire, WiFi, AsyncTCP,
     ESPAsyncWebServer, ArduinoJson, SD (optional)
+  - Flash filesystem is chosen at build time with STORAGE_BACKEND (SPIFFS, LittleFS, or POSIX
+    stdio on top of the mounted LittleFS). Switching reformats the data partition.
   - Flash this to an ESP32 board. Connect MFRC522 with SPI (SDA=SS_PIN, SCK, MOSI, MISO, RST)
   - Web UI will show /index.html, and you can add user names in any language (UTF-8)
-  - For production, add authentication to web UI (left simple here for clarity)
+  - Set ADMIN_PASSWORD before deploying: the web API and websocket need a token from
+    POST /api/auth/token (or the web page's login). ENABLE_AUTH 0 opens them up again.
 
   Wiring example (MFRC522):
     ESP32  MOSI -> MOSI
@@ -35,29 +65,142 @@
 #include <SPI.h>
 #include <FS.h>
 #include <SPIFFS.h>
+#include <LittleFS.h>
+#include <string>
+#include <time.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <bootloader_random.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/ecdsa.h>
+#include <mbedtls/md.h>
+#include <Preferences.h>
 #include <MFRC522.h>
 #include <ArduinoJson.h>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
-#include <SD.h> // optional: define ENABLE_SD to enable SD logging
+#include "scan_pipeline.h"
+#include "scheduler.h"
+#include "storage.h"
+#include "user_doc.h"
 
+// Flash storage backend, selected at build time
+#define STORAGE_SPIFFS 1
+#define STORAGE_LITTLEFS 2
+#define STORAGE_POSIX 3
+#define STORAGE_BACKEND STORAGE_SPIFFS
+
+// Set to 1 to run the storage benchmark once at boot (writes and removes /bench*)
+#define ENABLE_STORAGE_BENCH 0
+
+// Set to 1 to time the scan pipeline at boot against a runtime-polymorphic
+// build of the same stages (nothing is logged or changed)
+#define ENABLE_PIPELINE_BENCH 0
+
+// Set to 1 to inject a synthetic scan every JITTER_PROBE_MS (an unenrolled
+// card; nothing is logged, no feedback) and report its scan-to-feedback
+// latency, e.g. while load-testing the web API
+#define ENABLE_JITTER_PROBE 0
+
+// Set to 0 to start new attendance logs in plaintext (encrypted logs stay
+// readable as long as the key in NVS is kept; see LOG ENCRYPTION)
+#define ENABLE_LOG_ENCRYPTION 1
+
+// Set to 1 to measure log encryption and decryption throughput at boot
+#define ENABLE_LOG_CRYPTO_BENCH 0
+
+// Set to 1 to mirror the attendance log to an SD card (needs the SD library)
 #define ENABLE_SD 0
 
+#if ENABLE_SD
+#include <SD.h>
+#endif
+
+// Set to 0 to serve the web API and websocket to anyone on the network
+#define ENABLE_AUTH 1
+
 // ------------------ CONFIG ------------------
 // Put your WiFi credentials here (or implement WiFiManager later)
 const char* WIFI_SSID = "YourSSID";
 const char* WIFI_PASS = "YourPassword";
 
+// Web API and websocket logins (see AUTH). Clients log in with this
+// password at POST /api/auth/token and get a signed token to send as
+// "Authorization: Bearer <token>" or in the session cookie the login sets.
+// Reading needs a viewer token, anything else an admin token.
+const char* ADMIN_PASSWORD = "YourAdminPassword";
+const uint32_t AUTH_TOKEN_TTL_S = 86400;     // default lifetime
+const uint32_t AUTH_TOKEN_MAX_TTL_S = 2592000; // longest lifetime granted (30 days)
+const size_t AUTH_CACHE_SIZE = 8;            // recently verified tokens
+
 // Pins for MFRC522
 const uint8_t SS_PIN = 5;   // SDA
 const uint8_t RST_PIN = 22; // RST
 
 // Attendance log file (UTF-8 CSV)
-const char* ATTENDANCE_CSV = "/attendance.csv"; // on SPIFFS
+const char* ATTENDANCE_CSV = "/attendance.csv"; // on flash storage
 
-// Directory for users
+// CSV header line (after the UTF-8 BOM). A log with a different header is
+// set aside at boot as /attendance-old.csv and a new one is started.
+const char* LOG_HEADER = "seq,timestamp,hlc,card,user,name,method";
+
+// Directory for users, one /users/<id>.json per user. Files from before
+// user ids existed ({"uid": card, ...}) are migrated at boot with id = card.
 const char* USERS_DIR = "/users";
 
+// Time sync. Timestamps are UTC; before the first SNTP sync the clock runs
+// monotonically from the lease saved to CLOCK_FILE. Every save leases
+// CLOCK_LEASE_S ahead, so a reboot resumes past anything issued since.
+const char* NTP_SERVER = "pool.ntp.org";
+const char* CLOCK_FILE = "/clock.json";
+const uint32_t CLOCK_SAVE_INTERVAL_S = 600;
+const uint32_t CLOCK_LEASE_S = 2 * CLOCK_SAVE_INTERVAL_S;
+const time_t MIN_VALID_EPOCH = 1700000000; // earlier means the clock was never set
+
+// Event sequence numbers are reserved on flash in blocks, so a reboot skips
+// ahead instead of ever reusing a number.
+const char* SEQ_FILE = "/seq.json";
+const uint32_t SEQ_RESERVE = 256;
+
+// Hybrid logical clock: remote timestamps further ahead of our physical
+// clock than this are ignored instead of dragging our clock forward.
+const uint32_t HLC_MAX_DRIFT_MS = 60000;
+
+// Access rules: schedules, holidays, groups and roles (see ACCESS CONTROL).
+// Schedules are evaluated in local time given by this POSIX TZ string.
+const char* ACCESS_FILE = "/access.json";
+const char* TZ_INFO = "UTC0"; // e.g. "CET-1CEST,M3.5.0,M10.5.0/3"
+// Until the device has ever known the real time, schedules cannot be
+// evaluated: true lets scheduled users in, false keeps them out.
+const bool SCHEDULE_FAIL_OPEN = true;
+// Which door this reader guards (0..31), matched against door permissions
+const uint8_t DOOR_ID = 0;
+
+// Revoked cards (lost badges), kept apart from the user files so a central
+// server can push versioned deltas to the whole fleet (see REVOCATION)
+const char* REVOKED_FILE = "/revoked.bin";
+const size_t REVOKE_BLOOM_BITS = 8192; // prefilter, 1 KiB of RAM
+
+// Occupancy: the zone behind this door and which way people pass it.
+// DOOR_TOGGLE (single reader for in and out) flips the user's state per scan.
+enum DoorDirection { DOOR_ENTRY, DOOR_EXIT, DOOR_TOGGLE };
+const DoorDirection DOOR_DIRECTION = DOOR_TOGGLE;
+const uint8_t DOOR_ZONE = 0;          // 0..MAX_ZONES-1
+const uint8_t MAX_ZONES = 8;
+// Anti-passback: SOFT logs and flags a violation, HARD denies it
+enum AntiPassback { APB_OFF, APB_SOFT, APB_HARD };
+const AntiPassback ANTI_PASSBACK = APB_OFF;
+// Presence changes are journaled; the journal is rewritten as a snapshot
+// once it grows past this size.
+const char* PRESENCE_FILE = "/presence.log";
+const size_t PRESENCE_COMPACT_BYTES = 16384;
+
+// Daily per-user summaries: /reports/<yyyymmdd>.csv, written at local
+// midnight. Today's running totals are snapshotted so a reboot keeps them.
+const char* REPORTS_DIR = "/reports";
+const char* REPORT_TODAY_FILE = "/reports/today.csv";
+const uint32_t REPORT_SNAPSHOT_S = 300;
+
 // Buzzer and LED
 const uint8_t BUZZER_PIN = 13;
 const uint8_t LED_PIN = 2; // onboard LED
@@ -65,46 +208,585 @@ const uint8_t LED_PIN = 2; // onboard LED
 // Webserver port
 const int WEB_PORT = 80;
 
+// The scan task polls the reader at least this often
+const uint32_t RFID_POLL_MS = 20;
+const uint32_t JITTER_PROBE_MS = 50;
+
+// Task placement. Wi-Fi and lwIP run on core 0, so the web server and the
+// flash workers join them there and core 1 is left to card processing.
+// AsyncTCP creates its own task: its priority is set at boot, its core is a
+// build flag (-DCONFIG_ASYNC_TCP_RUNNING_CORE=0), checked at boot.
+// loop() runs the maintenance jobs (see SCHEDULER) on ARDUINO_RUNNING_CORE.
+struct TaskPlacement {
+  int8_t core;      // 0 or 1, -1 = either
+  uint8_t priority; // higher preempts lower on the same core
+};
+const TaskPlacement SCAN_TASK = {1, 5};      // reader and scan pipeline
+const TaskPlacement LOOP_TASK = {1, 1};      // maintenance jobs
+const TaskPlacement ASYNC_TCP_TASK = {0, 3}; // web server and websockets
+const TaskPlacement STORAGE_TASK = {0, 2};   // storage worker
+
+// Flash work for web requests runs on a storage worker task (see STORAGE
+// WORKER). Requests beyond this many queued jobs are answered with 503.
+const size_t STORAGE_QUEUE_DEPTH = 16;
+
+// Admission control (see ADMISSION): under pressure, web requests are
+// answered 503 lowest class first, keeping CPU, heap and flash for scans.
+// A request is shed when any limit of its class is crossed.
+enum AdmissionClass {
+  ADMIT_BACKGROUND, // downloads, exports, listings, history
+  ADMIT_NORMAL,     // provisioning: users, cards, access rules
+  ADMIT_CRITICAL,   // revocations, occupancy roll call
+  ADMIT_CLASSES
+};
+struct AdmissionLimits {
+  uint8_t maxQueued;       // storage worker jobs waiting
+  uint32_t minFreeHeap;    // bytes
+  uint8_t maxFlashBusyPct; // share of recent time spent writing flash
+};
+const AdmissionLimits ADMISSION_LIMITS[ADMIT_CLASSES] = {
+  {4, 60000, 30},
+  {10, 32000, 70},
+  {STORAGE_QUEUE_DEPTH, 16000, 100},
+};
+const uint32_t ADMISSION_RETRY_AFTER_S = 2;
+
+// Memory governor (see MEMORY GOVERNOR): degradation levels, entered when
+// free heap or the largest free block falls below the level's limits and
+// left once both are MEM_HYSTERESIS_BYTES above them again.
+enum MemLevel { MEM_NORMAL, MEM_TIGHT, MEM_LOW, MEM_CRITICAL, MEM_LEVELS };
+struct MemoryLevel {
+  const char *name;
+  uint32_t minFreeHeap;     // bytes
+  uint32_t minLargestBlock; // bytes
+  uint8_t wsClients;        // websocket clients kept
+};
+const MemoryLevel MEMORY_LEVELS[MEM_LEVELS] = {
+  {"normal", 0, 0, 8},
+  {"tight", 48000, 20000, 4},
+  {"low", 32000, 12000, 2},
+  {"critical", 20000, 8000, 0},
+};
+const uint32_t MEM_HYSTERESIS_BYTES = 8192;
+
+// Per-client rate limits (see RATE LIMITS): a token bucket per client IP
+// and limit, refilled at perSecond up to burst. Buckets are kept for the
+// RATE_CLIENTS most recently seen clients.
+enum RateLimitId { RATE_QUERY, RATE_PROVISION, RATE_DOWNLOAD, RATE_SYNC, RATE_WS_CONNECT, RATE_WS_MESSAGE, RATE_LOGIN, RATE_LIMITS };
+struct RateLimit {
+  const char *name;
+  float perSecond;
+  uint16_t burst;
+};
+const RateLimit RATE_LIMIT_TABLE[RATE_LIMITS] = {
+  {"query", 10, 30},      // listings, search, occupancy, metrics
+  {"provision", 2, 20},   // users, cards, access rules
+  {"download", 0.5f, 4},  // files, exports, reports, history
+  {"sync", 2, 10},        // revocations, HLC exchange
+  {"ws_connect", 0.2f, 4},
+  {"ws_message", 5, 20},
+  {"login", 0.1f, 5},     // password guesses and rejected tokens
+};
+const size_t RATE_CLIENTS = 16;
+
+// Attendance records are coalesced in RAM and written in flash-page-sized
+// chunks ending on a page boundary (256 = SPIFFS page, 4096 = erase sector).
+// A partial page is written once its oldest record is LOG_FLUSH_DEADLINE_MS
+// old; set the deadline to 0 to write every record immediately.
+const size_t LOG_PAGE_SIZE = 256;
+// Longest record the log writer takes; longer ones are refused whole
+const size_t LOG_RECORD_MAX = 512;
+const uint32_t LOG_FLUSH_DEADLINE_MS = 2000;
+const size_t FLASH_SECTOR_SIZE = 4096;
+
+// Hash chain over the attendance log (see LOG CHAIN): an entry per flushed
+// block, saved to CHAIN_FILE in batches every CHAIN_SAVE_MS
+const char* CHAIN_FILE = "/attendance.chain";
+// A log and a chain that reaches past its end are moved at boot to
+// <prefix>-<n>.csv and .chain, n = 1..CHAIN_BROKEN_MAX
+const char* CHAIN_BROKEN_PREFIX = "/attendance-broken";
+const int CHAIN_BROKEN_MAX = 9;
+const uint32_t CHAIN_SAVE_MS = 10000;
+
+// Per-user index over the attendance log, one file per LOG_SEGMENT_BYTES of
+// log (see LOG INDEX). Safe to delete; missing files are rebuilt at boot.
+const char* INDEX_DIR = "/idx";
+const uint32_t LOG_SEGMENT_BYTES = 65536;
+
+#if ENABLE_SD
+// SD card chip select. Must differ from the MFRC522 SS_PIN (SD.begin() defaults to 5).
+const uint8_t SD_CS_PIN = 15;
+// Mirror queue depth and the longest line it carries; anything that does not fit
+// is skipped here and replayed from the primary log instead.
+const size_t SD_QUEUE_DEPTH = 32;
+const size_t SD_LINE_MAX = 192;
+// How often the mirror task retries mounting a missing card
+const uint32_t SD_RETRY_MS = 2000;
+const TaskPlacement SD_TASK = {0, 1};
+#endif
+
 // ------------------ GLOBALS ------------------
 MFRC522 mfrc522(SS_PIN, RST_PIN);
 AsyncWebServer server(WEB_PORT);
 AsyncWebSocket ws("/ws");
 
-// Simple map in memory to cache user UID -> name (UTF-8). We load at startup.
+// Simple map in memory to cache user id -> name (UTF-8). We load at startup.
 // Using STL String (Arduino) which supports UTF-8 byte sequences.
 #include <map>
+#include <unordered_map>
 #include <vector>
-std::map<String, String> userCache; // uid -> utf8 name
+#include <algorithm>
+struct UserRecord {
+  String name;          // utf8
+  uint64_t groups;      // bit i = member of groupDefs[i]
+  int8_t schedule;      // own schedule (index into namedSchedules), or NO_SCHEDULE
+  int8_t role;          // index into roleDefs, -1 = none
+  uint16_t access;      // effective schedule: index into scheduleTable, or ACCESS_ALWAYS
+  uint32_t doors;       // effective door permissions, bit n = door n
+  uint8_t presence;     // 0 = outside, else zone + 1
+  uint32_t presenceSince; // wall time of the last presence change
+  String sortKey;       // collationKey(name), see SORTED LISTING
+  String folded;        // foldName(name), see NAME SEARCH
+  std::vector<String> cards; // card UIDs (hex), see CARDS
+  uint32_t expires;     // visitor pass: UTC epoch seconds, 0 = never
+};
+const uint16_t ACCESS_ALWAYS = 0xFFFF;
+std::map<String, UserRecord> userCache; // id -> user
+typedef std::map<String, UserRecord>::iterator UserRef;
+
+// ------------------ STORAGE ------------------
+// The Storage interface and PosixStorage are in storage.h; the Arduino
+// fs::FS backends and the build's choice of backend are here.
+
+class FsReader : public StorageReader {
+public:
+  explicit FsReader(File f) : f(f) {}
+  ~FsReader() { f.close(); }
+  size_t read(uint8_t *buf, size_t len) override { return f.read(buf, len); }
+  bool seek(uint32_t pos) override { return f.seek(pos); }
+  size_t size() override { return f.size(); }
+private:
+  File f;
+};
+
+// SPIFFS and LittleFS share the Arduino fs::FS API
+template <class FsType>
+class ArduinoFsStorage : public Storage {
+public:
+  ArduinoFsStorage(FsType &fs, const char *label) : fs(fs), label(label) {}
+  const char *name() const override { return label; }
+  bool begin() override { return fs.begin(true); }
+  bool exists(const char *path) override { return fs.exists(path); }
+  bool mkdir(const char *path) override { return fs.mkdir(path); }
+  bool remove(const char *path) override { return fs.remove(path); }
+  bool rename(const char *from, const char *to) override { return fs.rename(from, to); }
+  bool writeFile(const char *path, const uint8_t *data, size_t len) override { return put(path, FILE_WRITE, data, len); }
+  bool append(const char *path, const uint8_t *data, size_t len) override { return put(path, FILE_APPEND, data, len); }
+  std::unique_ptr<StorageReader> openRead(const char *path) override
+  {
+    File f = fs.open(path, FILE_READ);
+    if (!f || f.isDirectory()) return nullptr;
+    return std::unique_ptr<StorageReader>(new FsReader(f));
+  }
+  void list(const char *dir, std::function<void(const char *, size_t)> fn) override
+  {
+    File root = fs.open(dir);
+    if (!root) return;
+    File f = root.openNextFile();
+    while (f) {
+      if (!f.isDirectory()) {
+        // Older cores return the full path from name(), newer ones the basename
+        const char *n = f.name();
+        String path = n[0] == '/' ? String(n) : String(dir) + "/" + n;
+        fn(path.c_str(), f.size());
+      }
+      f = root.openNextFile();
+    }
+  }
+  size_t totalBytes() override { return fs.totalBytes(); }
+  size_t usedBytes() override { return fs.usedBytes(); }
+private:
+  bool put(const char *path, const char *mode, const uint8_t *data, size_t len)
+  {
+    File f = fs.open(path, mode);
+    if (!f) return false;
+    bool ok = f.write(data, len) == len;
+    f.close();
+    return ok;
+  }
+  FsType &fs;
+  const char *label;
+};
+
+// PosixStorage on the ESP32 lives on the LittleFS VFS mount
+const PosixVolume posixVolume = {
+  [](const char *base) { return LittleFS.begin(true, base); },
+  [](const char *) { return (size_t)LittleFS.totalBytes(); },
+  [](const char *) { return (size_t)LittleFS.usedBytes(); },
+};
+
+#if STORAGE_BACKEND == STORAGE_LITTLEFS
+ArduinoFsStorage<fs::LittleFSFS> storageImpl(LittleFS, "littlefs");
+#elif STORAGE_BACKEND == STORAGE_POSIX
+PosixStorage storageImpl("/littlefs", posixVolume);
+#else
+ArduinoFsStorage<fs::SPIFFSFS> storageImpl(SPIFFS, "spiffs");
+#endif
+
+// Flash writes can stall for a garbage collection or erase; the time spent
+// in them feeds admission control (see ADMISSION)
+volatile uint32_t flashBusyUs = 0; // total, wraps
+
+class TimedStorage : public Storage {
+public:
+  explicit TimedStorage(Storage &s) : s(s) {}
+  const char *name() const override { return s.name(); }
+  bool begin() override { return s.begin(); }
+  bool exists(const char *path) override { return s.exists(path); }
+  bool mkdir(const char *path) override { return timed([&] { return s.mkdir(path); }); }
+  bool remove(const char *path) override { return timed([&] { return s.remove(path); }); }
+  bool rename(const char *from, const char *to) override { return timed([&] { return s.rename(from, to); }); }
+  bool writeFile(const char *path, const uint8_t *data, size_t len) override { return timed([&] { return s.writeFile(path, data, len); }); }
+  bool append(const char *path, const uint8_t *data, size_t len) override { return timed([&] { return s.append(path, data, len); }); }
+  std::unique_ptr<StorageReader> openRead(const char *path) override { return s.openRead(path); }
+  void list(const char *dir, std::function<void(const char *, size_t)> fn) override { s.list(dir, fn); }
+  size_t totalBytes() override { return s.totalBytes(); }
+  size_t usedBytes() override { return s.usedBytes(); }
+private:
+  template <class Op> bool timed(Op op)
+  {
+    uint32_t t0 = micros();
+    bool ok = op();
+    __atomic_fetch_add(&flashBusyUs, micros() - t0, __ATOMIC_RELAXED);
+    return ok;
+  }
+  Storage &s;
+};
+
+TimedStorage timedStorage(storageImpl);
+Storage &storage = timedStorage;
+
+#if ENABLE_STORAGE_BENCH
+// runStorageBench (storage.h) at boot. LittleFS and POSIX share the LittleFS
+// partition, so a build with either benches both side by side; SPIFFS needs
+// its own build (flash one per STORAGE_BACKEND and compare the Serial output).
+const StorageBenchIo storageBenchIo = {
+  []() { return (uint32_t)micros(); },
+  [](const char *line) { Serial.println(line); },
+};
+
+// The other API over the same LittleFS partition
+#if STORAGE_BACKEND == STORAGE_LITTLEFS
+PosixStorage benchPeer("/littlefs", posixVolume);
+#elif STORAGE_BACKEND == STORAGE_POSIX
+ArduinoFsStorage<fs::LittleFSFS> benchPeer(LittleFS, "littlefs");
+#endif
+#endif
+
+// Replace a small file so that a power cut leaves either the old or the new
+// version: write path.tmp, then swap it in. readWholeFile falls back to .tmp.
+bool writeFileAtomic(const char *path, const uint8_t *data, size_t len)
+{
+  String tmp = String(path) + ".tmp";
+  if (!storage.writeFile(tmp.c_str(), data, len)) return false;
+  storage.remove(path);
+  return storage.rename(tmp.c_str(), path);
+}
+
+bool writeFileAtomic(const char *path, const String &data)
+{
+  return writeFileAtomic(path, (const uint8_t *)data.c_str(), data.length());
+}
+
+// Read a whole (small) file into a String; empty if missing
+String readWholeFile(const char *path)
+{
+  String out;
+  std::unique_ptr<StorageReader> r = storage.openRead(path);
+  if (!r) r = storage.openRead((String(path) + ".tmp").c_str());
+  if (!r) return out;
+  uint8_t buf[128];
+  size_t n;
+  while ((n = r->read(buf, sizeof(buf))) > 0) out.concat((const char *)buf, n);
+  return out;
+}
+
+// ------------------ LOG ENCRYPTION ------------------
+// The attendance log is personal data and is kept encrypted with AES-128-CTR
+// (the ESP32's AES unit behind mbedtls; the same calls run in software on
+// other targets). An encrypted log file starts with one plaintext line,
+// "#aes-128-ctr <nonce>\n", and every byte after it is XORed with the
+// keystream at its distance from that line. CTR keeps lengths, so offsets
+// into the log (the index, LogReader, the SD mirror) mean what they did,
+// and any range decrypts on its own. The log writer encrypts a page at a
+// time as it flushes, not record by record; downloads decrypt as they
+// stream (see streamFile).
+//
+// The key is made at first boot and kept in NVS, out of the filesystem that
+// /files serves. A log that no longer decrypts (NVS erased) is set aside
+// like one with an old column layout. Each new log file gets a random nonce.
+// The SD mirror stays plaintext: it is the copy to read when the device
+// itself is gone.
+
+const char *LOG_CIPHER_TAG = "#aes-128-ctr ";
+mbedtls_aes_context logAes;
+bool logKeyLoaded = false;
+
+// Random bytes before Wi-Fi is up: until the radio runs, esp_fill_random()
+// only has real entropy with the bootloader's source enabled
+void bootRandom(uint8_t *buf, size_t len)
+{
+  bootloader_random_enable();
+  esp_fill_random(buf, len);
+  bootloader_random_disable();
+}
+
+// Load the log key from NVS, making one on first boot. Called from setup()
+// before the log is opened.
+void logKeyBegin()
+{
+  uint8_t key[16];
+  Preferences prefs;
+  prefs.begin("log", false);
+  if (prefs.getBytes("key", key, sizeof(key)) != sizeof(key)) {
+    bootRandom(key, sizeof(key));
+    if (prefs.putBytes("key", key, sizeof(key)) != sizeof(key)) {
+      prefs.end();
+      Serial.println("[ERR] Cannot store the log key, new logs stay in plaintext");
+      return;
+    }
+    Serial.println("[LOG] New log encryption key");
+  }
+  prefs.end();
+  mbedtls_aes_init(&logAes);
+  logKeyLoaded = mbedtls_aes_setkey_enc(&logAes, key, 128) == 0;
+  memset(key, 0, sizeof(key));
+}
+
+// How one log file is encrypted, read from or written as its first line
+struct LogCipher {
+  bool on = false;
+  uint8_t nonce[8];
+  uint32_t start = 0; // offset of the first encrypted byte
+
+  // For a new file: encrypted if enabled and the key is available
+  static LogCipher fresh()
+  {
+    LogCipher c;
+    c.on = ENABLE_LOG_ENCRYPTION && logKeyLoaded;
+    if (c.on) {
+      bootRandom(c.nonce, sizeof(c.nonce));
+      c.start = c.line().length();
+    }
+    return c;
+  }
+
+  // The plaintext first line; empty for a plaintext file
+  String line() const
+  {
+    if (!on) return String();
+    char hex[17];
+    for (int i = 0; i < 8; ++i) sprintf(hex + i * 2, "%02x", nonce[i]);
+    return String(LOG_CIPHER_TAG) + hex + "\n";
+  }
+
+  // Read the first line of a file, leaving r at the first byte of content
+  void load(StorageReader &r)
+  {
+    size_t tag = strlen(LOG_CIPHER_TAG);
+    char head[32];
+    r.seek(0);
+    size_t n = r.read((uint8_t *)head, tag + 17);
+    on = n == tag + 17 && memcmp(head, LOG_CIPHER_TAG, tag) == 0 && head[tag + 16] == '\n';
+    for (int i = 0; on && i < 8; ++i) {
+      char byte[3] = {head[tag + i * 2], head[tag + i * 2 + 1], 0};
+      if (!isxdigit(byte[0]) || !isxdigit(byte[1])) on = false;
+      nonce[i] = strtoul(byte, NULL, 16);
+    }
+    start = on ? tag + 17 : 0;
+    r.seek(start);
+  }
+
+  // Encrypt or decrypt in place: buf holds the file's bytes from offset off
+  void apply(uint32_t off, uint8_t *buf, size_t len) const
+  {
+    if (!on || !logKeyLoaded) return;
+    if (off < start) {
+      size_t skip = std::min<size_t>(len, start - off);
+      off += skip;
+      buf += skip;
+      len -= skip;
+    }
+    if (len == 0) return;
+    uint32_t pos = off - start;
+    uint8_t counter[16], stream[16];
+    memcpy(counter, nonce, 8);
+    uint64_t block = pos / 16;
+    for (int i = 0; i < 8; ++i) counter[15 - i] = block >> (8 * i);
+    size_t within = pos % 16;
+    if (within) {
+      // Starting mid-block: mbedtls expects that block's keystream and the next counter
+      mbedtls_aes_crypt_ecb(&logAes, MBEDTLS_AES_ENCRYPT, counter, stream);
+      for (int i = 15; i >= 8 && ++counter[i] == 0; --i) {}
+    }
+    mbedtls_aes_crypt_ctr(&logAes, len, &within, counter, stream, buf, buf);
+  }
+};
+
+LogCipher logCipher; // the attendance log's, set at boot
+
+// Encrypt a plaintext log into path.enc and swap it in (boot only). A reset
+// between the remove and the rename is finished by ensureAttendanceCSV().
+bool logEncryptCopy(const char *path)
+{
+  LogCipher c = LogCipher::fresh();
+  std::unique_ptr<StorageReader> r = storage.openRead(path);
+  String enc = String(path) + ".enc", head = c.line();
+  if (!c.on || !r || !storage.writeFile(enc.c_str(), (const uint8_t *)head.c_str(), head.length())) return false;
+  size_t size = r->size();
+  std::vector<uint8_t> buf(FLASH_SECTOR_SIZE);
+  uint32_t off = c.start;
+  size_t n;
+  bool ok = true;
+  while (ok && (n = r->read(buf.data(), buf.size())) > 0) {
+    c.apply(off, buf.data(), n);
+    ok = storage.append(enc.c_str(), buf.data(), n);
+    off += n;
+  }
+  r.reset();
+  if (!ok || off - c.start != size) {
+    storage.remove(enc.c_str());
+    return false;
+  }
+  storage.remove(path);
+  if (!storage.rename(enc.c_str(), path)) return false;
+  logCipher = c;
+  return true;
+}
+
+#if ENABLE_LOG_CRYPTO_BENCH
+// Keystream throughput in the shapes the log uses: page-sized, page-aligned
+// batches as the writer flushes (encrypt) and 1 KiB reads at unaligned
+// offsets as downloads and LogReader decrypt, then a whole pass over the
+// stored log with and without decryption. One 70-byte record on its own
+// shows what encrypting per scan would have cost.
+void runLogCryptoBench()
+{
+  LogCipher c = LogCipher::fresh();
+  if (!c.on) {
+    Serial.println("[BENCH] log encryption off, nothing to measure");
+    return;
+  }
+  static uint8_t buf[1024];
+  memset(buf, 'x', sizeof(buf));
+  const int rounds = 256;
+  auto mbps = [&](size_t chunk, uint32_t skew) {
+    uint32_t t0 = micros();
+    for (int i = 0; i < rounds; ++i) c.apply(c.start + skew + i * chunk, buf, chunk);
+    uint32_t dt = micros() - t0;
+    return dt ? (float)chunk * rounds / dt : 0.0f; // bytes per us = MB/s
+  };
+  Serial.printf("[BENCH] encrypt %u B pages: %.2f MB/s\n", (unsigned)std::min(LOG_PAGE_SIZE, sizeof(buf)),
+                mbps(std::min(LOG_PAGE_SIZE, sizeof(buf)), 0));
+  Serial.printf("[BENCH] decrypt 1 KiB reads at odd offsets: %.2f MB/s\n", mbps(sizeof(buf), 7));
+  uint32_t t0 = micros();
+  for (int i = 0; i < rounds; ++i) c.apply(c.start + i * 70, buf, 70);
+  Serial.printf("[BENCH] one 70 B record: %.1f us\n", (micros() - t0) / (float)rounds);
+
+  for (int pass = 0; pass < 2; ++pass) {
+    std::unique_ptr<StorageReader> r = storage.openRead(ATTENDANCE_CSV);
+    if (!r) break;
+    LogCipher lc;
+    lc.load(*r);
+    uint32_t off = lc.start, t1 = micros();
+    size_t n;
+    while ((n = r->read(buf, sizeof(buf))) > 0) {
+      if (pass) lc.apply(off, buf, n);
+      off += n;
+    }
+    uint32_t dt = micros() - t1;
+    Serial.printf("[BENCH] log read%s: %u B, %.1f KiB/s\n", pass ? " + decrypt" : "", (unsigned)(off - lc.start),
+                  dt ? (off - lc.start) * 1e6f / 1024 / dt : 0.0f);
+  }
+}
+#endif
 
 // ------------------ UTILITIES ------------------
 
-// Ensure SPIFFS is mounted and users dir exists
-void ensureSPIFFS()
+// Ensure flash storage is mounted and users dir exists
+void ensureStorage()
 {
-  if (!SPIFFS.begin(true)) {
-    Serial.println("[ERR] SPIFFS mount failed");
+  if (!storage.begin()) {
+    Serial.printf("[ERR] %s mount failed\n", storage.name());
     return;
   }
-  if (!SPIFFS.exists(USERS_DIR)) {
-    SPIFFS.mkdir(USERS_DIR);
+  if (!storage.exists(USERS_DIR)) {
+    storage.mkdir(USERS_DIR);
   }
 }
 
-// Write CSV header with UTF-8 BOM if file doesn't exist
-void ensureAttendanceCSV()
+bool chainSetAside(uint32_t content); // see LOG CHAIN
+
+// Write CSV header with UTF-8 BOM if file doesn't exist, encrypting a new log
+// or an existing plaintext one (see LOG ENCRYPTION). Sets logCipher.
+// Returns true if a new (empty) log was started or offsets changed.
+bool ensureAttendanceCSV()
 {
-  if (!SPIFFS.exists(ATTENDANCE_CSV)) {
-    File f = SPIFFS.open(ATTENDANCE_CSV, FILE_WRITE);
-    if (!f) {
-      Serial.println("[ERR] Cannot create attendance CSV");
-      return;
+  // Write UTF-8 BOM so Excel recognizes UTF-8
+  String header = String("\xEF\xBB\xBF") + LOG_HEADER + "\r\n";
+  String enc = String(ATTENDANCE_CSV) + ".enc";
+  if (!storage.exists(ATTENDANCE_CSV) && storage.exists(enc.c_str())) storage.rename(enc.c_str(), ATTENDANCE_CSV);
+  std::unique_ptr<StorageReader> r = storage.openRead(ATTENDANCE_CSV);
+  if (r) {
+    LogCipher c;
+    c.load(*r);
+    char first[64];
+    size_t n = r->read((uint8_t *)first, std::min(sizeof(first), (size_t)header.length()));
+    uint32_t content = r->size() - c.start;
+    r.reset();
+    c.apply(c.start, (uint8_t *)first, n);
+    bool valid = n == header.length() && memcmp(first, header.c_str(), n) == 0;
+    if (valid && chainSetAside(content)) {
+      // Kept with its chain as evidence; a new log starts below
+    } else if (valid) {
+      logCipher = c;
+      if (c.on || !ENABLE_LOG_ENCRYPTION || !logKeyLoaded) return false;
+      // From before encryption: the copy moves every record by the nonce line
+      if (logEncryptCopy(ATTENDANCE_CSV)) {
+        Serial.println("[LOG] Existing log encrypted");
+        return true;
+      }
+      Serial.println("[ERR] Cannot encrypt the existing log, it stays in plaintext");
+      return false;
+    } else {
+      // Older column layout or lost key: keep it, but start a fresh log
+      storage.remove("/attendance-old.csv");
+      storage.rename(ATTENDANCE_CSV, "/attendance-old.csv");
+      storage.remove("/attendance-old.chain");
+      storage.rename(CHAIN_FILE, "/attendance-old.chain");
+      Serial.println("[LOG] Log format changed or unreadable, previous log moved to /attendance-old.csv");
     }
-    // Write UTF-8 BOM so Excel recognizes UTF-8
-    const uint8_t bom[3] = {0xEF, 0xBB, 0xBF};
-    f.write(bom, 3);
-    f.println("timestamp,uid,name,method");
-    f.close();
   }
+  storage.remove(CHAIN_FILE);
+  logCipher = LogCipher::fresh();
+  String head = logCipher.line();
+  std::vector<uint8_t> buf(head.length() + header.length());
+  memcpy(buf.data(), head.c_str(), head.length());
+  memcpy(buf.data() + head.length(), header.c_str(), header.length());
+  logCipher.apply(0, buf.data(), buf.size());
+  if (!storage.writeFile(ATTENDANCE_CSV, buf.data(), buf.size())) {
+    Serial.println("[ERR] Cannot create attendance CSV");
+  }
+  return true;
+}
+
+// Create a task with its configured placement
+bool startTask(TaskFunction_t fn, const char *name, uint32_t stack, const TaskPlacement &p, TaskHandle_t *handle = NULL)
+{
+  BaseType_t core = p.core < 0 ? tskNO_AFFINITY : p.core;
+  if (xTaskCreatePinnedToCore(fn, name, stack, NULL, p.priority, handle, core) == pdPASS) return true;
+  Serial.printf("[ERR] Cannot start task %s\n", name);
+  return false;
 }
 
 // CSV-safe: wrap string in quotes and escape internal quotes
@@ -119,83 +801,3144 @@ String csvEsc(const String &s) {
   return out;
 }
 
-// Get current timestamp string (Unix seconds). For demo we use millis()/1000 + boot epoch.
-String nowTimestamp() {
-  unsigned long t = millis() / 1000; // demo timestamp
-  return String(t);
+// ------------------ SCHEDULER ------------------
+// Maintenance work in loop() runs on the Scheduler from scheduler.h, driven
+// by millis().
+
+uint32_t schedulerClock() { return millis(); }
+Scheduler scheduler(schedulerClock);
+
+// Print jobs that overran since the last report
+void schedulerReport()
+{
+  static std::map<int, uint32_t> reported;
+  for (const Scheduler::Task &t : scheduler.list()) {
+    uint32_t &seen = reported[t.id];
+    if (t.overruns == seen) continue;
+    Serial.printf("[SCHED] %s: %u overruns (max late %u ms, max run %u ms)\n", t.name, (unsigned)(t.overruns - seen),
+                  (unsigned)t.maxLateMs, (unsigned)t.maxRunMs);
+    seen = t.overruns;
+  }
 }
 
-// Log attendance (append to CSV). method = "rfid" or "web" etc.
-void logAttendance(const String &uid, const String &name, const String &method)
+// Copy of the job stats for /api/metrics: the web handler runs on the
+// AsyncTCP task while scheduler.run() changes the job list, so loop()
+// publishes a copy (SCHED_PUBLISH_MS) and the handler reads that
+const uint32_t SCHED_PUBLISH_MS = 1000;
+
+struct TaskStats {
+  const char *name;
+  uint32_t period, runs, overruns, skipped, maxLateMs, maxRunMs;
+};
+SemaphoreHandle_t schedStatsMutex = NULL;
+std::vector<TaskStats> schedStats; // under schedStatsMutex
+
+void schedulerPublish()
 {
-  ensureAttendanceCSV();
-  File f = SPIFFS.open(ATTENDANCE_CSV, FILE_APPEND);
-  if (!f) {
-    Serial.println("[ERR] Cannot open attendance CSV for append");
-    return;
+  std::vector<TaskStats> stats;
+  stats.reserve(scheduler.list().size());
+  for (const Scheduler::Task &t : scheduler.list()) {
+    stats.push_back({t.name, t.period, t.runs, t.overruns, t.skipped, t.maxLateMs, t.maxRunMs});
+  }
+  xSemaphoreTake(schedStatsMutex, portMAX_DELAY);
+  schedStats.swap(stats);
+  xSemaphoreGive(schedStatsMutex);
+}
+
+// ------------------ STORAGE WORKER ------------------
+// Web handlers run on the AsyncTCP task, so a slow flash operation there
+// (a SPIFFS write that has to garbage-collect a block can take hundreds of
+// ms) stalls every HTTP and websocket connection. Handlers queue their
+// flash work here instead: work() runs on the storage worker task, then
+// done() and reply() run on loop(). done() updates in-memory state;
+// reply() answers the request, and is skipped if the client has gone.
+// Jobs run one at a time in queue order, so writers never interleave.
+
+typedef std::function<void(AsyncWebServerRequest *request, bool ok)> StorageReply;
+
+// The request a job answers; cleared when the client disconnects
+struct PendingRequest {
+  AsyncWebServerRequest *request;
+};
+
+struct StorageJob {
+  std::function<bool()> work;
+  std::function<void(bool)> done;          // may be empty
+  StorageReply reply;                      // may be empty
+  std::shared_ptr<PendingRequest> pending; // NULL for background jobs
+  uint32_t queuedMs;
+  bool ok;
+};
+
+QueueHandle_t storageQueue = NULL; // StorageJob*, to the worker
+QueueHandle_t storageDone = NULL;  // StorageJob*, back to loop()
+SemaphoreHandle_t replyMutex = NULL;
+
+struct StorageStats {
+  uint32_t jobs, failed;
+  uint32_t refused;    // queue full, answered 503
+  uint32_t abandoned;  // client gone before the reply
+  uint32_t highWater;  // most jobs queued at once
+  uint32_t maxWaitMs;  // longest time a job sat in the queue
+  uint32_t maxRunMs;   // longest job
+} storageStats;
+
+// Held while replying, and by the disconnect callback, so a request is
+// never freed while a reply is being sent on it
+struct ReplyLock {
+  ReplyLock() { xSemaphoreTake(replyMutex, portMAX_DELAY); }
+  ~ReplyLock() { xSemaphoreGive(replyMutex); }
+};
+
+void storageWorkerTask(void *)
+{
+  StorageJob *job;
+  for (;;) {
+    if (xQueueReceive(storageQueue, &job, portMAX_DELAY) != pdTRUE) continue;
+    uint32_t start = millis();
+    job->ok = job->work();
+    uint32_t end = millis();
+    storageStats.maxWaitMs = std::max(storageStats.maxWaitMs, start - job->queuedMs);
+    storageStats.maxRunMs = std::max(storageStats.maxRunMs, end - start);
+    xQueueSend(storageDone, &job, portMAX_DELAY);
   }
-  String line = nowTimestamp() + "," + csvEsc(uid) + "," + csvEsc(name) + "," + csvEsc(method);
-  f.println(line);
-  f.close();
-  Serial.println("[LOG] " + line);
-#ifdef ENABLE_SD
-  // If SD enabled, also append to SD for redundancy
-  File sd = SD.open(ATTENDANCE_CSV, FILE_APPEND);
-  if (sd) { sd.println(line); sd.close(); }
-#endif
 }
 
-// Utility: write a user JSON to SPIFFS: /users/<uid>.json
-bool writeUserToFS(const String &uid, const String &utf8name)
+// Queue work for the worker. Returns false if the queue is full, in which
+// case a request, if given, has been answered with 503.
+bool storageSubmit(AsyncWebServerRequest *request, std::function<bool()> work, std::function<void(bool)> done, StorageReply reply)
 {
-  String path = String(USERS_DIR) + "/" + uid + ".json";
-  DynamicJsonDocument doc(256);
-  doc["uid"] = uid;
-  doc["name"] = utf8name;
-  File f = SPIFFS.open(path, FILE_WRITE);
-  if (!f) return false;
-  if (serializeJson(doc, f) == 0) {
-    f.close();
+  StorageJob *job = new StorageJob{work, done, reply, NULL, (uint32_t)millis(), false};
+  if (request) {
+    std::shared_ptr<PendingRequest> p(new PendingRequest{request});
+    job->pending = p;
+    // Before queueing: the reply may be sent as soon as the job is queued
+    request->onDisconnect([p]() {
+      ReplyLock lock;
+      p->request = NULL;
+    });
+  }
+  if (!storageQueue || xQueueSend(storageQueue, &job, 0) != pdTRUE) {
+    storageStats.refused++;
+    delete job;
+    if (request) request->send(503, "text/plain", "Storage busy, try again");
     return false;
   }
-  f.close();
-  return true;
+  storageStats.highWater = std::max(storageStats.highWater, (uint32_t)uxQueueMessagesWaiting(storageQueue));
+  return true;
+}
+
+// Called from loop(): finish the jobs the worker has completed
+void storagePoll()
+{
+  StorageJob *job;
+  while (xQueueReceive(storageDone, &job, 0) == pdTRUE) {
+    storageStats.jobs++;
+    if (!job->ok) storageStats.failed++;
+    if (job->done) job->done(job->ok);
+    if (job->pending) {
+      ReplyLock lock;
+      if (!job->pending->request) storageStats.abandoned++;
+      else if (job->reply) job->reply(job->pending->request, job->ok);
+    }
+    delete job;
+  }
+}
+
+void startStorageWorker()
+{
+  replyMutex = xSemaphoreCreateMutex();
+  storageQueue = xQueueCreate(STORAGE_QUEUE_DEPTH, sizeof(StorageJob *));
+  storageDone = xQueueCreate(STORAGE_QUEUE_DEPTH, sizeof(StorageJob *));
+  if (!replyMutex || !storageQueue || !storageDone) {
+    Serial.println("[ERR] Storage worker allocation failed");
+    return;
+  }
+  startTask(storageWorkerTask, "storage", 6144, STORAGE_TASK);
+}
+
+// ------------------ MEMORY GOVERNOR ------------------
+// Steps through MEMORY_LEVELS as the heap tightens, giving up web features
+// so that scanning and logging never run out of memory. Each level keeps
+// the measures of the ones before it:
+//   tight     fewer websocket clients; scan pushes lose their verbose fields
+//             and pushes are dropped while any client's queue is full
+//   low       downloads and exports refused, running ones paused
+//   critical  web connections closed on arrival, websockets closed
+// Levels are entered as far as the limits say in one step, and left one
+// level per poll.
+
+volatile uint8_t memLevel = MEM_NORMAL;
+
+struct MemTransition {
+  uint32_t atS; // uptime
+  uint8_t from, to;
+  uint32_t freeHeap, largestBlock;
+};
+const size_t MEM_HISTORY = 8;
+MemTransition memHistory[MEM_HISTORY]; // ring, newest at memTransitions - 1
+uint32_t memTransitions = 0;
+uint32_t wsPushesDropped = 0;
+
+// Called from loop()
+void memoryPoll()
+{
+  uint32_t freeHeap = ESP.getFreeHeap(), largest = ESP.getMaxAllocHeap();
+  auto below = [&](const MemoryLevel &m, uint32_t margin) {
+    return freeHeap < m.minFreeHeap + margin || largest < m.minLargestBlock + margin;
+  };
+  uint8_t level = memLevel, next = level;
+  while (next + 1 < MEM_LEVELS && below(MEMORY_LEVELS[next + 1], 0)) next++;
+  if (next == level && level > MEM_NORMAL && !below(MEMORY_LEVELS[level], MEM_HYSTERESIS_BYTES)) next--;
+  if (next == level) return;
+  memHistory[memTransitions++ % MEM_HISTORY] = {(uint32_t)(millis() / 1000), level, next, freeHeap, largest};
+  memLevel = next;
+  Serial.printf("[MEM] %s -> %s (free %u, largest block %u)\n", MEMORY_LEVELS[level].name, MEMORY_LEVELS[next].name,
+                (unsigned)freeHeap, (unsigned)largest);
+}
+
+// First handler on the server: at the critical level every request,
+// websocket upgrades included, has its connection closed before any
+// response is allocated
+class MemoryGate : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest *) override { return memLevel >= MEM_CRITICAL; }
+  void handleRequest(AsyncWebServerRequest *request) override { request->client()->close(true); }
+};
+MemoryGate memoryGate;
+
+// ------------------ ADMISSION ------------------
+// Web requests are admitted by class (ADMISSION_LIMITS). Pressure is judged
+// from the storage worker's queue, free heap, and the share of the last
+// sampling period spent in flash writes (any task, scans included), and
+// the memory governor's level. A shed request gets 503 with Retry-After
+// and is counted per class and reason.
+
+enum ShedReason { SHED_QUEUE, SHED_HEAP, SHED_FLASH, SHED_MEMORY, SHED_REASONS };
+const char *ADMISSION_CLASS_NAMES[ADMIT_CLASSES] = {"background", "normal", "critical"};
+
+uint32_t admitCount[ADMIT_CLASSES];
+uint32_t shedCount[ADMIT_CLASSES][SHED_REASONS];
+volatile uint8_t flashBusyPct = 0; // smoothed, updated by admissionSample()
+
+// Called from loop(): flash busy share since the last call, smoothed
+void admissionSample()
+{
+  static uint32_t lastBusy = 0, lastUs = 0;
+  uint32_t busy = flashBusyUs, now = micros();
+  if (lastUs && now != lastUs) {
+    uint32_t pct = std::min<uint64_t>(100, (uint64_t)(busy - lastBusy) * 100 / (now - lastUs));
+    flashBusyPct = (flashBusyPct + pct + 1) / 2;
+  }
+  lastBusy = busy;
+  lastUs = now;
+}
+
+// True if the request may proceed; otherwise it has been answered 503
+bool admit(AsyncWebServerRequest *request, AdmissionClass cls)
+{
+  const AdmissionLimits &lim = ADMISSION_LIMITS[cls];
+  int reason = -1;
+  if (memLevel >= MEM_CRITICAL || (memLevel >= MEM_LOW && cls == ADMIT_BACKGROUND)) reason = SHED_MEMORY;
+  else if (storageQueue && uxQueueMessagesWaiting(storageQueue) >= lim.maxQueued) reason = SHED_QUEUE;
+  else if (ESP.getFreeHeap() < lim.minFreeHeap) reason = SHED_HEAP;
+  else if (flashBusyPct > lim.maxFlashBusyPct) reason = SHED_FLASH;
+  if (reason < 0) {
+    admitCount[cls]++;
+    return true;
+  }
+  shedCount[cls][reason]++;
+  AsyncWebServerResponse *res = request->beginResponse(503, "text/plain", "Busy, try again later");
+  res->addHeader("Retry-After", String(ADMISSION_RETRY_AFTER_S));
+  request->send(res);
+  return false;
+}
+
+// Route wrappers: server.on(uri, method, admitted(cls, handler))
+ArRequestHandlerFunction admitted(AdmissionClass cls, ArRequestHandlerFunction fn)
+{
+  return [cls, fn](AsyncWebServerRequest *request) {
+    if (admit(request, cls)) fn(request);
+  };
+}
+
+// Bodies are judged on their first chunk. Later chunks of a shed request
+// find no body buffer and are dropped by collectBody().
+ArBodyHandlerFunction admittedBody(AdmissionClass cls, ArBodyHandlerFunction fn)
+{
+  return [cls, fn](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    if (index == 0 && !admit(request, cls)) return;
+    fn(request, data, len, index, total);
+  };
+}
+
+// ------------------ RATE LIMITS ------------------
+// Token buckets per client IP and limit (RATE_LIMIT_TABLE) in a fixed table
+// of RATE_CLIENTS entries. A client not in the table takes over the least
+// recently seen entry with full buckets. Only used on the AsyncTCP task
+// (HTTP handlers and websocket events), so there is no lock.
+
+struct RateClient {
+  bool used;
+  uint32_t ip;
+  uint32_t seenMs; // last refill, also the LRU order
+  float tokens[RATE_LIMITS];
+};
+RateClient rateClients[RATE_CLIENTS];
+uint32_t rateAllowed[RATE_LIMITS], rateLimited[RATE_LIMITS];
+uint32_t rateEvictions = 0;
+
+// ip's entry with its buckets refilled up to now
+RateClient &rateRefill(uint32_t ip)
+{
+  uint32_t now = millis();
+  RateClient *c = NULL, *lru = &rateClients[0];
+  for (RateClient &e : rateClients) {
+    if (e.used && e.ip == ip) {
+      c = &e;
+      break;
+    }
+    if (!lru->used) continue; // a free entry beats any used one
+    if (!e.used || (int32_t)(e.seenMs - lru->seenMs) < 0) lru = &e;
+  }
+  if (!c) {
+    if (lru->used) rateEvictions++;
+    c = lru;
+    c->used = true;
+    c->ip = ip;
+    c->seenMs = now;
+    for (int l = 0; l < RATE_LIMITS; ++l) c->tokens[l] = RATE_LIMIT_TABLE[l].burst;
+  }
+  float dt = (now - c->seenMs) / 1000.0f;
+  c->seenMs = now;
+  for (int l = 0; l < RATE_LIMITS; ++l) {
+    c->tokens[l] = std::min<float>(RATE_LIMIT_TABLE[l].burst, c->tokens[l] + dt * RATE_LIMIT_TABLE[l].perSecond);
+  }
+  return *c;
+}
+
+// True if ip's bucket has a token left, without taking it
+bool rateHasToken(uint32_t ip, RateLimitId limit)
+{
+  return rateRefill(ip).tokens[limit] >= 1;
+}
+
+// Take a token from ip's bucket; false if it is empty, with the seconds
+// until the next token in retryAfterS
+bool rateAllow(uint32_t ip, RateLimitId limit, uint32_t *retryAfterS = NULL)
+{
+  float &t = rateRefill(ip).tokens[limit];
+  if (t >= 1) {
+    t -= 1;
+    rateAllowed[limit]++;
+    return true;
+  }
+  rateLimited[limit]++;
+  if (retryAfterS) *retryAfterS = (uint32_t)ceilf((1 - t) / RATE_LIMIT_TABLE[limit].perSecond);
+  return false;
+}
+
+// True if the client may proceed; otherwise it has been answered 429
+bool rateCheck(AsyncWebServerRequest *request, RateLimitId limit)
+{
+  uint32_t retry = 1;
+  if (rateAllow(request->client()->remoteIP(), limit, &retry)) return true;
+  AsyncWebServerResponse *res = request->beginResponse(429, "text/plain", "Too many requests");
+  res->addHeader("Retry-After", String(retry));
+  request->send(res);
+  return false;
+}
+
+// Route wrappers: server.on(uri, method, limited(limit, handler))
+ArRequestHandlerFunction limited(RateLimitId limit, ArRequestHandlerFunction fn)
+{
+  return [limit, fn](AsyncWebServerRequest *request) {
+    if (rateCheck(request, limit)) fn(request);
+  };
+}
+
+// Bodies are charged on their first chunk, as in admittedBody()
+ArBodyHandlerFunction limitedBody(RateLimitId limit, ArBodyHandlerFunction fn)
+{
+  return [limit, fn](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    if (index == 0 && !rateCheck(request, limit)) return;
+    fn(request, data, len, index, total);
+  };
+}
+
+// ------------------ CLOCK & SEQUENCE ------------------
+// Wall time comes from SNTP, or from the RTC if it survived a reset. Without
+// either, time continues monotonically from the saved lease: a wall time no
+// timestamp reaches before the next save, like the SEQ_RESERVE blocks. So
+// timestamps never run backwards across reboots; a reboot without a time
+// source skips ahead by up to CLOCK_LEASE_S instead.
+
+enum TimeSource { TIME_MONOTONIC, TIME_RTC, TIME_SNTP };
+const char *TIME_SOURCE_NAMES[] = {"monotonic", "rtc", "sntp"};
+
+volatile TimeSource clockSource = TIME_MONOTONIC;
+time_t bootEpoch = 0;          // wall time at millis() == 0 for the monotonic clock
+time_t lastIssued = 0;         // latest second handed out; time never goes below it
+time_t lastClockSave = 0;
+char tsCache[24] = "1970-01-01T00:00:00Z";
+uint16_t weekSlot = 0;         // local 15-minute slot of the week, Monday 00:00 = 0
+uint32_t localDay = 0;         // local date as yyyymmdd
+time_t localDayStart = 0;      // wall time of local midnight today
+
+String deviceId;               // efuse MAC, unique per device
+uint32_t seqNext = 0;          // next event sequence number
+uint32_t seqReserved = 0;      // numbers below this are reserved on flash
+volatile bool seqRefilling = false; // next block is being reserved by the storage worker
+SemaphoreHandle_t seqMutex = NULL;  // one writer of SEQ_FILE at a time
+uint32_t seqPersisted = 0;          // largest reservation on flash, under seqMutex
+
+void clockTick();
+bool seqPersist(uint32_t reserved);
+void seqRaise(uint32_t reserved);
+void chainAdd(const uint8_t *data, size_t len); // see LOG CHAIN
+
+void onSntpSync(struct timeval *)
+{
+  clockSource = TIME_SNTP;
+}
+
+uint64_t hlcLast = 0; // see HYBRID LOGICAL CLOCK below
+portMUX_TYPE hlcMux = portMUX_INITIALIZER_UNLOCKED; // scans and web handlers both tick it
+uint64_t wallMillis();
+TimeSource savedSource = TIME_MONOTONIC; // clockSource at the last save
+
+// Besides the wall-time lease, an HLC no event reaches before the next
+// save: our clock then plus the lease plus the furthest a peer may pull it
+// ahead (HLC_MAX_DRIFT_MS)
+void saveClock(time_t now)
+{
+  portENTER_CRITICAL(&hlcMux);
+  uint64_t hlc = std::max(hlcLast, wallMillis() << 16);
+  portEXIT_CRITICAL(&hlcMux);
+  hlc += ((uint64_t)CLOCK_LEASE_S * 1000 + HLC_MAX_DRIFT_MS) << 16;
+  char buf[17];
+  sprintf(buf, "%016llx", (unsigned long long)hlc);
+  writeFileAtomic(CLOCK_FILE, String("{\"last\":") + String((unsigned long)now) + ",\"lease\":" +
+                  String((unsigned long)(now + CLOCK_LEASE_S)) + ",\"hlc_lease\":\"" + buf + "\"}");
+  lastClockSave = now;
+  savedSource = clockSource;
+}
+
+void clockBegin()
+{
+  char mac[13];
+  uint64_t efuse = ESP.getEfuseMac();
+  for (int i = 0; i < 6; ++i) sprintf(mac + i * 2, "%02X", (unsigned)((efuse >> (8 * i)) & 0xFF));
+  deviceId = mac;
+
+  DynamicJsonDocument doc(128);
+  time_t saved = 0, lease = 0;
+  if (!deserializeJson(doc, readWholeFile(CLOCK_FILE))) {
+    saved = doc["last"] | 0UL;
+    lease = doc["lease"] | (unsigned long)(saved + CLOCK_SAVE_INTERVAL_S); // older files: next save was due then
+    if (doc["hlc_lease"].is<const char *>()) {
+      hlcLast = strtoull(doc["hlc_lease"].as<const char *>(), NULL, 16);
+    } else {
+      // Older files saved the clock itself
+      hlcLast = strtoull(doc["hlc"] | "0", NULL, 16);
+      if (hlcLast) hlcLast += ((uint64_t)CLOCK_SAVE_INTERVAL_S * 1000 + HLC_MAX_DRIFT_MS) << 16;
+    }
+  }
+  setenv("TZ", TZ_INFO, 1);
+  tzset();
+  time_t now = time(nullptr);
+  if (now >= MIN_VALID_EPOCH && now >= saved) {
+    // The RTC kept counting, so it is past anything issued from it
+    clockSource = TIME_RTC;
+    lastIssued = saved;
+  } else {
+    bootEpoch = lease + 1 - millis() / 1000;
+    lastIssued = lease;
+  }
+
+  doc.clear();
+  if (!deserializeJson(doc, readWholeFile(SEQ_FILE))) seqNext = doc["reserved"] | 0UL;
+  seqPersisted = seqNext;
+  // Reserve the first block now so the first scan does not write
+  if (seqPersist(seqNext + SEQ_RESERVE)) seqRaise(seqNext + SEQ_RESERVE);
+  Serial.printf("[CLOCK] device %s, source %s, seq from %u\n", deviceId.c_str(),
+                TIME_SOURCE_NAMES[clockSource], (unsigned)seqNext);
+  clockTick();
+}
+
+// Start SNTP once the network is up. configTime() would reset TZ to UTC;
+// configTzTime() keeps local time (week slots, holidays, reports) in TZ_INFO.
+void clockStartSntp()
+{
+  sntp_set_time_sync_notification_cb(onSntpSync);
+  configTzTime(TZ_INFO, NTP_SERVER);
+}
+
+// Current wall time in Unix seconds, never earlier than anything issued before
+time_t wallNow()
+{
+  time_t t = clockSource == TIME_MONOTONIC ? bootEpoch + (time_t)(millis() / 1000) : time(nullptr);
+  if (t < lastIssued) t = lastIssued;
+  lastIssued = t;
+  return t;
+}
+
+// Called from loop(): refreshes the cached timestamp once per second
+void clockTick()
+{
+  static time_t shown = 0;
+  time_t now = wallNow();
+  if (now == shown) return;
+  shown = now;
+  struct tm tmv;
+  gmtime_r(&now, &tmv);
+  strftime(tsCache, sizeof(tsCache), "%Y-%m-%dT%H:%M:%SZ", &tmv);
+  localtime_r(&now, &tmv);
+  weekSlot = ((tmv.tm_wday + 6) % 7) * 96 + tmv.tm_hour * 4 + tmv.tm_min / 15;
+  localDay = (tmv.tm_year + 1900) * 10000 + (tmv.tm_mon + 1) * 100 + tmv.tm_mday;
+  localDayStart = now - (tmv.tm_hour * 3600 + tmv.tm_min * 60 + tmv.tm_sec);
+  // A new time source may step the clock past the leases: renew them at once
+  if (now - lastClockSave >= (time_t)CLOCK_SAVE_INTERVAL_S || clockSource != savedSource) saveClock(now);
+}
+
+// Wall time in milliseconds (not clamped; the HLC takes care of ordering)
+uint64_t wallMillis()
+{
+  if (clockSource == TIME_MONOTONIC) return (uint64_t)bootEpoch * 1000 + millis();
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// True once the device has had a real time source at some point
+bool clockValid()
+{
+  return lastIssued >= MIN_VALID_EPOCH;
+}
+
+// ISO-8601 UTC timestamp of the current second (cached, no formatting per call)
+String nowTimestamp() {
+  return String(tsCache);
+}
+
+// Write a reservation unless a larger one is already on flash, so SEQ_FILE
+// never goes backwards whichever of the scan task and the worker writes last.
+// Takes only seqMutex: the scan task calls this under LogLock.
+bool seqPersist(uint32_t reserved)
+{
+  xSemaphoreTake(seqMutex, portMAX_DELAY);
+  bool ok = reserved <= seqPersisted ||
+            writeFileAtomic(SEQ_FILE, String("{\"reserved\":") + String((unsigned long)reserved) + "}");
+  if (ok) seqPersisted = std::max(seqPersisted, reserved);
+  xSemaphoreGive(seqMutex);
+  if (!ok) Serial.println("[ERR] Cannot persist sequence reservation");
+  return ok;
+}
+
+// seqReserved only grows; the worker and the scan task may both raise it
+void seqRaise(uint32_t reserved)
+{
+  uint32_t cur = __atomic_load_n(&seqReserved, __ATOMIC_RELAXED);
+  while (reserved > cur &&
+         !__atomic_compare_exchange_n(&seqReserved, &cur, reserved, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Next device-unique event sequence number. Called under LogLock on the scan
+// task. Half way through a block the storage worker reserves the next one,
+// so the scan only writes flash itself if the worker fell half a block behind
+// or has not started yet. It never waits for the worker, which may itself be
+// waiting for LogLock.
+uint32_t nextSeq()
+{
+  if (seqNext >= seqReserved) {
+    seqPersist(seqNext + SEQ_RESERVE);
+    seqRaise(seqNext + SEQ_RESERVE);
+  } else if (!seqRefilling && seqReserved - seqNext <= SEQ_RESERVE / 2) {
+    uint32_t next = seqReserved + SEQ_RESERVE;
+    seqRefilling = true;
+    if (!storageSubmit(NULL, [next]() {
+          bool ok = seqPersist(next);
+          if (ok) seqRaise(next);
+          seqRefilling = false;
+          return ok;
+        }, NULL, NULL)) {
+      seqRefilling = false;
+    }
+  }
+  return seqNext++;
+}
+
+// ------------------ HYBRID LOGICAL CLOCK ------------------
+// Each event gets a 64-bit HLC: physical milliseconds in the upper 48 bits,
+// a logical counter in the lower 16. It never runs backwards, stays close to
+// wall time, and is merged with the peer's clock on every sync exchange, so
+// events from all doors can be ordered by HLC alone (ties: device, seq).
+// Across reboots it resumes from the bound leased in CLOCK_FILE (saveClock).
+
+uint32_t hlcRejected = 0; // remote clocks too far ahead
+
+const uint64_t HLC_COUNTER_MASK = 0xFFFF;
+
+// Timestamp a local event
+uint64_t hlcNow()
+{
+  uint64_t pt = wallMillis() << 16;
+  portENTER_CRITICAL(&hlcMux);
+  // Same or earlier millisecond: bump the counter (carries into the ms part on overflow)
+  hlcLast = pt > hlcLast ? pt : hlcLast + 1;
+  uint64_t out = hlcLast;
+  portEXIT_CRITICAL(&hlcMux);
+  return out;
+}
+
+// Merge a clock received from a peer or the collector; returns our new HLC
+uint64_t hlcMerge(uint64_t remote)
+{
+  uint64_t pt = wallMillis() << 16;
+  if ((remote >> 16) > (pt >> 16) + HLC_MAX_DRIFT_MS) {
+    hlcRejected++;
+    return hlcNow();
+  }
+  portENTER_CRITICAL(&hlcMux);
+  uint64_t l = std::max(pt, std::max(hlcLast, remote)) & ~HLC_COUNTER_MASK;
+  uint64_t c = 0;
+  if (l == (hlcLast & ~HLC_COUNTER_MASK)) c = (hlcLast & HLC_COUNTER_MASK) + 1;
+  if (l == (remote & ~HLC_COUNTER_MASK)) c = std::max(c, (remote & HLC_COUNTER_MASK) + 1);
+  hlcLast = l + c; // c == 0x10000 carries into the next millisecond
+  uint64_t out = hlcLast;
+  portEXIT_CRITICAL(&hlcMux);
+  return out;
+}
+
+// Fixed-width hex so HLCs sort correctly as strings
+String hlcToString(uint64_t hlc)
+{
+  char buf[17];
+  sprintf(buf, "%016llx", (unsigned long long)hlc);
+  return String(buf);
+}
+
+// ------------------ ACCESS CONTROL ------------------
+// Access rules live in ACCESS_FILE and are compiled when users are loaded or
+// changed, so the scan path only does a lookup, an AND and a bit test.
+//
+// Schedules: weekly windows compiled into bitmaps of 15-minute slots (672
+// bits). A user's effective schedule is the union of their own schedule and
+// their groups' schedules; identical results are interned into scheduleTable,
+// so a user costs two bytes for it. Entries are reference counted and reused
+// once no user holds them, so edits do not grow the table.
+// Doors: groups and roles grant door permission bitsets (bit n = DOOR_ID n).
+// A user's effective set is the OR over their groups and role.
+//
+// ACCESS_FILE example:
+// {
+//   "holidays": ["2026-12-25", "2027-01-01"],
+//   "schedules": {
+//     "office": {"windows": [{"days": "mon-fri", "from": "07:30", "to": "19:00"}]},
+//     "night":  {"windows": [{"days": "sun-thu", "from": "22:00", "to": "06:00"}], "holidays": true}
+//   },
+//   "groups": {"staff": {"schedule": "office", "doors": [0, 1]}, "cleaning": {"schedule": "night"}},
+//   "roles": {"admin": {"doors": "all"}, "facilities": {"doors": [0, 1, 2, 3]}}
+// }
+// Users opt in with "schedule", "groups": [...] and "role". Users with no
+// schedule anywhere have no time restriction; users with no group and no role
+// may use every door, and so may groups/roles without "doors". Windows ending
+// at or before their start run past midnight. Holidays deny unless the
+// schedule sets "holidays": true.
+
+const uint16_t SLOTS_PER_WEEK = 7 * 24 * 4;
+const uint32_t ALL_DOORS = 0xFFFFFFFF;
+const uint32_t DOOR_BIT = 1UL << DOOR_ID;
+const size_t MAX_GROUPS = 64;          // width of UserRecord::groups
+const int8_t NO_SCHEDULE = -1;
+const int8_t UNKNOWN_SCHEDULE = -2;    // referenced but not defined: grants no time
+
+struct ScheduleBits {
+  uint32_t w[(SLOTS_PER_WEEK + 31) / 32];
+  bool holidays; // also valid on holidays
+  bool test(uint16_t slot) const { return (w[slot >> 5] >> (slot & 31)) & 1; }
+  void set(uint16_t slot) { w[slot >> 5] |= 1UL << (slot & 31); }
+  void merge(const ScheduleBits &o)
+  {
+    for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); ++i) w[i] |= o.w[i];
+    holidays |= o.holidays;
+  }
+  bool operator==(const ScheduleBits &o) const { return holidays == o.holidays && memcmp(w, o.w, sizeof(w)) == 0; }
+};
+
+struct GroupDef {
+  String name;
+  int8_t schedule;   // index into namedSchedules, NO_SCHEDULE or UNKNOWN_SCHEDULE
+  uint32_t doors;
+};
+
+struct RoleDef {
+  String name;
+  uint32_t doors;
+};
+
+std::vector<ScheduleBits> scheduleTable;        // interned effective schedules
+std::vector<uint16_t> scheduleRefs;             // users per scheduleTable entry, 0 = free
+size_t scheduleLive = 0;                        // entries with users
+std::vector<String> scheduleNames;              // parallel to namedSchedules
+std::vector<ScheduleBits> namedSchedules;       // compiled from ACCESS_FILE
+std::vector<GroupDef> groupDefs;                // bit i of UserRecord::groups
+std::vector<RoleDef> roleDefs;
+std::vector<uint32_t> holidays;                 // sorted, yyyymmdd
+uint32_t holidayCheckedDay = 0;
+bool holidayToday = false;
+uint32_t scheduleDenials = 0;
+uint32_t doorDenials = 0;
+volatile bool accessReloadPending = false;      // set by the web handler, done in loop()
+
+// Guards userCache and the tables above: scans run on the scan task, edits arrive on
+// the web server task. Recursive so compile helpers can be nested.
+SemaphoreHandle_t accessMutex = NULL;
+struct AccessLock {
+  AccessLock() { xSemaphoreTakeRecursive(accessMutex, portMAX_DELAY); }
+  ~AccessLock() { xSemaphoreGiveRecursive(accessMutex); }
+};
+
+int parseWeekday(const String &d)
+{
+  static const char *names[] = {"mon", "tue", "wed", "thu", "fri", "sat", "sun"};
+  for (int i = 0; i < 7; ++i) if (d.equalsIgnoreCase(names[i])) return i;
+  return -1;
+}
+
+// "mon-fri", "sat,sun", "all" -> days[0..6] (Monday first)
+bool parseDays(const String &spec, bool days[7])
+{
+  for (int i = 0; i < 7; ++i) days[i] = spec.equalsIgnoreCase("all");
+  if (days[0]) return true;
+  int start = 0;
+  while (start < (int)spec.length()) {
+    int comma = spec.indexOf(',', start);
+    if (comma < 0) comma = spec.length();
+    String part = spec.substring(start, comma);
+    part.trim();
+    int dash = part.indexOf('-');
+    int a = parseWeekday(dash < 0 ? part : part.substring(0, dash));
+    int b = dash < 0 ? a : parseWeekday(part.substring(dash + 1));
+    if (a < 0 || b < 0) return false;
+    for (int d = a;; d = (d + 1) % 7) { days[d] = true; if (d == b) break; }
+    start = comma + 1;
+  }
+  return true;
+}
+
+// "HH:MM" -> minutes since midnight, -1 if malformed. "24:00" is the end
+// of the day; no other 24:MM is.
+int parseHHMM(const char *s)
+{
+  int h, m;
+  if (!s || sscanf(s, "%d:%d", &h, &m) != 2 || h < 0 || h > 24 || m < 0 || m > 59) return -1;
+  if (h == 24 && m != 0) return -1;
+  return h * 60 + m;
+}
+
+bool compileSchedule(JsonObject def, ScheduleBits &out)
+{
+  memset(&out, 0, sizeof(out));
+  out.holidays = def["holidays"] | false;
+  for (JsonVariant win : def["windows"].as<JsonArray>()) {
+    bool days[7];
+    int from = parseHHMM(win["from"]), to = parseHHMM(win["to"]);
+    if (!parseDays(win["days"] | "all", days) || from < 0 || to < 0) return false;
+    int first = from / 15, last = (to + 14) / 15; // [first, last) in slots of the day
+    if (last <= first) last += 96;                // runs past midnight
+    for (int d = 0; d < 7; ++d) {
+      if (!days[d]) continue;
+      for (int s = first; s < last; ++s) out.set((d * 96 + s) % SLOTS_PER_WEEK);
+    }
+  }
+  return true;
+}
+
+// [0, 2, 5] or "all" (or missing) -> door bitset
+uint32_t parseDoors(JsonVariant v)
+{
+  if (!v.is<JsonArray>()) return ALL_DOORS;
+  uint32_t mask = 0;
+  for (JsonVariant d : v.as<JsonArray>()) {
+    int id = d | -1;
+    if (id >= 0 && id < 32) mask |= 1UL << id;
+  }
+  return mask;
+}
+
+int8_t findSchedule(const String &name, const std::vector<String> &names = scheduleNames)
+{
+  if (name.length() == 0) return NO_SCHEDULE;
+  for (size_t i = 0; i < names.size(); ++i) if (names[i] == name) return i;
+  Serial.println("[ACCESS] Unknown schedule '" + name + "' (grants no time)");
+  return UNKNOWN_SCHEDULE;
+}
+
+int findGroup(const String &name)
+{
+  for (size_t i = 0; i < groupDefs.size(); ++i) if (groupDefs[i].name == name) return i;
+  return -1;
+}
+
+int findRole(const String &name)
+{
+  for (size_t i = 0; i < roleDefs.size(); ++i) if (roleDefs[i].name == name) return i;
+  return -1;
+}
+
+GroupDef parseGroup(const String &name, JsonVariant def, const std::vector<String> &names = scheduleNames)
+{
+  GroupDef g;
+  g.name = name;
+  g.schedule = findSchedule(def["schedule"] | "", names);
+  g.doors = parseDoors(def["doors"]);
+  return g;
+}
+
+// ACCESS_FILE compiled, not yet installed
+struct AccessConfig {
+  std::vector<String> scheduleNames;
+  std::vector<ScheduleBits> schedules;
+  std::vector<uint32_t> holidays;
+  std::vector<GroupDef> groups;
+  std::vector<RoleDef> roles;
+};
+
+// Parse and compile ACCESS_FILE (empty = no rules). Needs no lock.
+bool parseAccessConfig(const String &body, AccessConfig &cfg)
+{
+  DynamicJsonDocument doc(std::max<size_t>(2048, body.length() * 2));
+  if (body.length() && deserializeJson(doc, body)) return false;
+  for (JsonPair kv : doc["schedules"].as<JsonObject>()) {
+    ScheduleBits b;
+    if (!compileSchedule(kv.value().as<JsonObject>(), b) || cfg.schedules.size() >= 127) {
+      Serial.printf("[ACCESS] Bad schedule '%s'\n", kv.key().c_str());
+      return false;
+    }
+    cfg.scheduleNames.push_back(kv.key().c_str());
+    cfg.schedules.push_back(b);
+  }
+  for (JsonVariant h : doc["holidays"].as<JsonArray>()) {
+    int y, m, d;
+    if (sscanf(h | "", "%d-%d-%d", &y, &m, &d) == 3) cfg.holidays.push_back(y * 10000 + m * 100 + d);
+  }
+  std::sort(cfg.holidays.begin(), cfg.holidays.end());
+  for (JsonPair kv : doc["groups"].as<JsonObject>()) {
+    if (cfg.groups.size() == MAX_GROUPS) {
+      Serial.println("[ACCESS] Too many groups, ignoring the rest");
+      break;
+    }
+    cfg.groups.push_back(parseGroup(kv.key().c_str(), kv.value(), cfg.scheduleNames));
+  }
+  for (JsonPair kv : doc["roles"].as<JsonObject>()) {
+    RoleDef r;
+    r.name = kv.key().c_str();
+    r.doors = parseDoors(kv.value()["doors"]);
+    cfg.roles.push_back(r);
+  }
+  return true;
+}
+
+// Swap in a compiled config. Caller recompiles users afterwards.
+void installAccessConfig(AccessConfig &cfg)
+{
+  AccessLock lock;
+  scheduleNames.swap(cfg.scheduleNames);
+  namedSchedules.swap(cfg.schedules);
+  holidays.swap(cfg.holidays);
+  holidayCheckedDay = 0;
+  scheduleTable.clear();
+  scheduleRefs.clear();
+  scheduleLive = 0;
+  for (auto &kv : userCache) kv.second.access = ACCESS_ALWAYS; // recompiled by the caller
+  groupDefs.swap(cfg.groups);
+  roleDefs.swap(cfg.roles);
+}
+
+// Nothing is changed unless the whole file is valid
+bool loadAccessConfig(const String &body)
+{
+  AccessConfig cfg;
+  if (!parseAccessConfig(body, cfg)) return false;
+  installAccessConfig(cfg);
+  return true;
+}
+
+uint16_t internSchedule(const ScheduleBits &b)
+{
+  size_t slot = scheduleTable.size();
+  for (size_t i = 0; i < scheduleTable.size(); ++i) {
+    if (!scheduleRefs[i]) {
+      if (slot == scheduleTable.size()) slot = i;
+    } else if (scheduleTable[i] == b) {
+      scheduleRefs[i]++;
+      return i;
+    }
+  }
+  if (slot == scheduleTable.size()) {
+    scheduleTable.push_back(b);
+    scheduleRefs.push_back(0);
+  }
+  scheduleTable[slot] = b;
+  scheduleRefs[slot] = 1;
+  scheduleLive++;
+  return slot;
+}
+
+void releaseSchedule(uint16_t access)
+{
+  if (access == ACCESS_ALWAYS || access >= scheduleRefs.size() || !scheduleRefs[access]) return;
+  if (--scheduleRefs[access] == 0) scheduleLive--;
+}
+
+// Precompute a user's effective schedule and door set from their references
+void compileUser(UserRecord &u)
+{
+  ScheduleBits eff;
+  memset(&eff, 0, sizeof(eff));
+  bool scheduled = u.schedule != NO_SCHEDULE;
+  if (u.schedule >= 0) eff.merge(namedSchedules[u.schedule]);
+  bool restricted = u.role >= 0 || u.groups != 0;
+  uint32_t doors = u.role >= 0 ? roleDefs[u.role].doors : 0;
+  for (size_t i = 0; i < groupDefs.size(); ++i) {
+    if (!((u.groups >> i) & 1)) continue;
+    const GroupDef &g = groupDefs[i];
+    doors |= g.doors;
+    if (g.schedule != NO_SCHEDULE) scheduled = true;
+    if (g.schedule >= 0) eff.merge(namedSchedules[g.schedule]);
+  }
+  u.doors = restricted ? doors : ALL_DOORS;
+  uint16_t old = u.access;
+  u.access = scheduled ? internSchedule(eff) : ACCESS_ALWAYS;
+  releaseSchedule(old);
+}
+
+// A user's access references by name, as in their file
+struct UserRefs {
+  String schedule, role;
+  std::vector<String> groups;
+};
+
+UserRefs userRefs(JsonDocument &doc)
+{
+  UserRefs r;
+  r.schedule = doc["schedule"] | "";
+  r.role = doc["role"] | "";
+  for (JsonVariant g : doc["groups"].as<JsonArray>()) r.groups.push_back(g.as<String>());
+  return r;
+}
+
+// The references a loaded user resolved to (unknown names are lost)
+UserRefs userRefs(const UserRecord &u)
+{
+  UserRefs r;
+  if (u.schedule >= 0) r.schedule = scheduleNames[u.schedule];
+  if (u.role >= 0) r.role = roleDefs[u.role].name;
+  for (size_t i = 0; i < groupDefs.size(); ++i) if ((u.groups >> i) & 1) r.groups.push_back(groupDefs[i].name);
+  return r;
+}
+
+void resolveUserRefs(const UserRefs &r, UserRecord &u)
+{
+  u.schedule = findSchedule(r.schedule);
+  u.groups = 0;
+  for (const String &g : r.groups) {
+    int gi = findGroup(g);
+    if (gi >= 0) u.groups |= 1ULL << gi;
+    else Serial.println("[ACCESS] Unknown group '" + g + "'");
+  }
+  u.role = findRole(r.role);
+  compileUser(u);
+}
+
+// Resolve the access fields of a user document ({"schedule", "groups", "role"})
+void resolveUserRefs(JsonDocument &doc, UserRecord &u)
+{
+  resolveUserRefs(userRefs(doc), u);
+}
+
+// Create or replace one group and recompile only its members
+void updateGroup(const String &name, JsonVariant def)
+{
+  AccessLock lock;
+  int gi = findGroup(name);
+  if (gi < 0) {
+    if (groupDefs.size() == MAX_GROUPS) return;
+    gi = groupDefs.size();
+    groupDefs.push_back(GroupDef());
+  }
+  groupDefs[gi] = parseGroup(name, def);
+  uint64_t bit = 1ULL << gi;
+  for (auto &kv : userCache) {
+    if (kv.second.groups & bit) compileUser(kv.second);
+  }
+}
+
+bool isHolidayToday()
+{
+  if (holidayCheckedDay != localDay) {
+    holidayToday = std::binary_search(holidays.begin(), holidays.end(), localDay);
+    holidayCheckedDay = localDay;
+  }
+  return holidayToday;
+}
+
+// Scan-time check: a lookup and a bit test
+bool scheduleAllows(uint16_t access)
+{
+  if (access == ACCESS_ALWAYS) return true;
+  if (!clockValid()) return SCHEDULE_FAIL_OPEN;
+  const ScheduleBits &b = scheduleTable[access];
+  if (!b.holidays && isHolidayToday()) return false;
+  return b.test(weekSlot);
+}
+
+// ------------------ OCCUPANCY ------------------
+// Each user carries one presence byte (outside, or inside zone n) and the
+// zones keep running totals, so a passage costs O(1) and a roll call never
+// touches the attendance log. Changes are journaled as "<id> <state> <since>"
+// lines, written in batches with the attendance log flush and compacted into
+// a snapshot when the journal grows.
+
+uint16_t zoneOccupancy[MAX_ZONES];
+uint32_t passbackViolations = 0;
+String presencePending;              // journal lines not yet on flash
+unsigned long presencePendingMs = 0;
+size_t presenceJournalBytes = 0;
+volatile bool occupancyChanged = false;
+
+const char *DOOR_DIRECTION_NAMES[] = {"entry", "exit", "toggle"};
+
+// Would this passage be consistent with the user's recorded state?
+bool passbackOk(const UserRecord &u)
+{
+  bool inside = u.presence == DOOR_ZONE + 1;
+  if (DOOR_DIRECTION == DOOR_ENTRY) return !inside;
+  if (DOOR_DIRECTION == DOOR_EXIT) return inside;
+  return true;
+}
+
+void presenceSet(UserRecord &u, uint8_t state, uint32_t since)
+{
+  if (u.presence && zoneOccupancy[u.presence - 1]) zoneOccupancy[u.presence - 1]--;
+  if (state) zoneOccupancy[state - 1]++;
+  u.presence = state;
+  u.presenceSince = since;
+}
+
+// Record an accepted passage through this door (caller holds AccessLock)
+void presenceMove(const String &id, UserRecord &u)
+{
+  uint8_t next;
+  if (DOOR_DIRECTION == DOOR_ENTRY) next = DOOR_ZONE + 1;
+  else if (DOOR_DIRECTION == DOOR_EXIT) next = 0;
+  else next = u.presence == DOOR_ZONE + 1 ? 0 : DOOR_ZONE + 1;
+  if (next == u.presence) return; // soft anti-passback repeat
+  presenceSet(u, next, wallNow());
+  if (presencePending.length() == 0) presencePendingMs = millis();
+  presencePending += id + " " + String(next) + " " + String((unsigned long)u.presenceSince) + "\n";
+  occupancyChanged = true;
+}
+
+// Rewrite the journal as one line per user who is inside somewhere
+void presenceCompact()
+{
+  String snap;
+  {
+    AccessLock lock;
+    for (auto &kv : userCache) {
+      if (!kv.second.presence) continue;
+      snap += kv.first + " " + String(kv.second.presence) + " " + String((unsigned long)kv.second.presenceSince) + "\n";
+    }
+    presencePending = "";
+  }
+  if (writeFileAtomic(PRESENCE_FILE, snap)) presenceJournalBytes = snap.length();
+}
+
+// Called from loop(): flush batched journal lines on the log's deadline
+void presencePoll()
+{
+  if (presencePending.length() == 0) return;
+  if (millis() - presencePendingMs < LOG_FLUSH_DEADLINE_MS && presencePending.length() < LOG_PAGE_SIZE) return;
+  String out;
+  {
+    AccessLock lock;
+    out = presencePending;
+    presencePending = "";
+  }
+  if (presenceJournalBytes + out.length() > PRESENCE_COMPACT_BYTES) {
+    presenceCompact();
+    return;
+  }
+  if (storage.append(PRESENCE_FILE, (const uint8_t *)out.c_str(), out.length())) {
+    presenceJournalBytes += out.length();
+  } else {
+    Serial.println("[ERR] Cannot append presence journal");
+  }
+}
+
+// Replay the journal onto userCache and rebuild zone totals. Boot only:
+// later, userCache already holds the live presence. Moves not yet flushed
+// are replayed after the journal so none is lost.
+void presenceRestore()
+{
+  AccessLock lock;
+  memset(zoneOccupancy, 0, sizeof(zoneOccupancy));
+  for (auto &kv : userCache) { kv.second.presence = 0; kv.second.presenceSince = 0; }
+  String journal = readWholeFile(PRESENCE_FILE);
+  presenceJournalBytes = journal.length();
+  journal += presencePending;
+  int start = 0;
+  while (start < (int)journal.length()) {
+    int end = journal.indexOf('\n', start);
+    if (end < 0) break;
+    String line = journal.substring(start, end);
+    start = end + 1;
+    int sp1 = line.indexOf(' '), sp2 = line.indexOf(' ', sp1 + 1);
+    if (sp1 <= 0 || sp2 <= sp1) continue;
+    auto it = userCache.find(line.substring(0, sp1));
+    int state = line.substring(sp1 + 1, sp2).toInt();
+    if (it == userCache.end() || state < 0 || state > MAX_ZONES) continue;
+    presenceSet(it->second, state, strtoul(line.c_str() + sp2 + 1, NULL, 10));
+  }
+}
+
+// Everyone clears out (e.g. after an evacuation or at night)
+void presenceReset()
+{
+  {
+    AccessLock lock;
+    for (auto &kv : userCache) presenceSet(kv.second, 0, 0);
+    memset(zoneOccupancy, 0, sizeof(zoneOccupancy));
+    presencePending = "";
+  }
+  presenceCompact();
+  occupancyChanged = true;
+}
+
+// ------------------ NAME SEARCH ------------------
+// Typeahead over user names. Names are folded to a search form: lower case,
+// accents removed (Latin, Greek, Cyrillic), katakana as hiragana, full-width
+// ASCII as ASCII, punctuation as a single space. Each user keeps one folded
+// name (UserRecord::folded); nameIndex is a sorted array of (user, byte
+// offset of a word start) into it, 8 bytes per word, so one binary search
+// finds names with a word starting with the query ("sch" finds
+// "Anna Schmidt"). When that yields too few results, up to NAME_SCAN_MAX
+// names are scanned for substrings, which bounds the time a query holds
+// AccessLock.
+
+// U+00C0..U+00FF and U+0100..U+017F: base letter, '*' = expands to two
+// letters (see foldCodepoint), '.' = kept as is
+static const char FOLD_LATIN1[] = "aaaaaa*ceeeeiiiidnooooo.ouuuuy**aaaaaa*ceeeeiiiidnooooo.ouuuuy*y";
+static const char FOLD_LATIN_EXT_A[] =
+  "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii**jjkkkllllllllllnnnnnnnnnoooooo**rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+const size_t NAME_MAX_KEYS = 8;     // word starts indexed per name
+const size_t NAME_SCAN_MAX = 2000;  // names scanned for substrings per query
+
+struct NameEntry {
+  UserRef user;
+  uint16_t offset; // word start in user->second.folded
+  const char *key() const { return user->second.folded.c_str() + offset; }
+};
+std::vector<NameEntry> nameIndex; // sorted by key, then id
+bool usersLoading = false;        // loadUsers() rebuilds nameIndex once at the end
+
+void utf8Append(String &out, uint32_t cp)
+{
+  if (cp < 0x80) {
+    out += (char)cp;
+  } else if (cp < 0x800) {
+    out += (char)(0xC0 | cp >> 6);
+    out += (char)(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += (char)(0xE0 | cp >> 12);
+    out += (char)(0x80 | ((cp >> 6) & 0x3F));
+    out += (char)(0x80 | (cp & 0x3F));
+  } else {
+    out += (char)(0xF0 | cp >> 18);
+    out += (char)(0x80 | ((cp >> 12) & 0x3F));
+    out += (char)(0x80 | ((cp >> 6) & 0x3F));
+    out += (char)(0x80 | (cp & 0x3F));
+  }
+}
+
+// Decode the code point at s[i] and advance i; malformed bytes give U+FFFD
+uint32_t utf8Next(const String &s, size_t &i)
+{
+  uint8_t c = s[i++];
+  if (c < 0x80) return c;
+  int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+  if (more < 0) return 0xFFFD;
+  uint32_t cp = c & (0x3F >> more);
+  for (int k = 0; k < more; ++k) {
+    if (i >= s.length() || (s[i] & 0xC0) != 0x80) return 0xFFFD;
+    cp = cp << 6 | (s[i++] & 0x3F);
+  }
+  return cp;
+}
+
+void foldSpace(String &out)
+{
+  if (out.length() && !out.endsWith(" ")) out += ' ';
+}
+
+// Append the search form of one code point to out
+void foldCodepoint(uint32_t cp, String &out)
+{
+  if (cp >= 0xFF01 && cp <= 0xFF5E) cp -= 0xFEE0; // full-width ASCII
+  if (cp < 0x80) {
+    if (isalnum(cp)) out += (char)tolower(cp);
+    else if (cp != '\'') foldSpace(out); // O'Brien -> obrien
+    return;
+  }
+  if (cp == 0xA0 || cp == 0x3000) {
+    foldSpace(out);
+    return;
+  }
+  if (cp >= 0xC0 && cp <= 0x17F) {
+    char f = cp < 0x100 ? FOLD_LATIN1[cp - 0xC0] : FOLD_LATIN_EXT_A[cp - 0x100];
+    if (f == '*') {
+      out += cp == 0xC6 || cp == 0xE6 ? "ae" : cp == 0xDE || cp == 0xFE ? "th" : cp == 0xDF ? "ss" :
+             cp == 0x132 || cp == 0x133 ? "ij" : "oe";
+      return;
+    }
+    if (f != '.') {
+      out += f;
+      return;
+    }
+  }
+  if (cp >= 0x300 && cp <= 0x36F) return; // combining accents (decomposed input)
+  if (cp >= 0x386 && cp <= 0x3CE) {
+    // Greek: drop tonos/dialytika, lower case, final sigma
+    static const uint16_t accented[][2] = {
+      {0x386, 0x3B1}, {0x388, 0x3B5}, {0x389, 0x3B7}, {0x38A, 0x3B9}, {0x38C, 0x3BF}, {0x38E, 0x3C5},
+      {0x38F, 0x3C9}, {0x390, 0x3B9}, {0x3AA, 0x3B9}, {0x3AB, 0x3C5}, {0x3AC, 0x3B1}, {0x3AD, 0x3B5},
+      {0x3AE, 0x3B7}, {0x3AF, 0x3B9}, {0x3B0, 0x3C5}, {0x3C2, 0x3C3}, {0x3CA, 0x3B9}, {0x3CB, 0x3C5},
+      {0x3CC, 0x3BF}, {0x3CD, 0x3C5}, {0x3CE, 0x3C9}};
+    for (auto &m : accented) {
+      if (cp == m[0]) cp = m[1];
+    }
+    if (cp >= 0x391 && cp <= 0x3A9) cp += 0x20;
+  } else if (cp >= 0x400 && cp <= 0x45F) {
+    // Cyrillic: lower case, ё as е
+    if (cp < 0x410) cp += 0x50;
+    else if (cp < 0x430) cp += 0x20;
+    if (cp == 0x451) cp = 0x435;
+  } else if (cp >= 0x30A1 && cp <= 0x30F6) {
+    cp -= 0x60; // katakana -> hiragana
+  }
+  utf8Append(out, cp);
+}
+
+String foldName(const String &name)
+{
+  String out;
+  size_t i = 0;
+  while (i < name.length()) foldCodepoint(utf8Next(name, i), out);
+  if (out.endsWith(" ")) out.remove(out.length() - 1, 1);
+  return out;
+}
+
+// Calls fn with the offset of each word start in a folded name
+void nameKeys(const String &folded, std::function<void(uint16_t)> fn)
+{
+  int i = 0;
+  for (size_t k = 0; k < NAME_MAX_KEYS && i < (int)folded.length() && i <= 0xFFFF; ++k) {
+    fn(i);
+    i = folded.indexOf(' ', i);
+    if (i < 0) break;
+    ++i;
+  }
+}
+
+bool nameEntryLess(const NameEntry &a, const NameEntry &b)
+{
+  int c = strcmp(a.key(), b.key());
+  return c < 0 || (c == 0 && strcmp(a.user->first.c_str(), b.user->first.c_str()) < 0);
+}
+
+// Incremental updates (caller holds AccessLock). u->second.folded must not
+// change while u is in the index.
+void nameIndexAdd(UserRef u)
+{
+  nameKeys(u->second.folded, [u](uint16_t off) {
+    NameEntry e{u, off};
+    nameIndex.insert(std::lower_bound(nameIndex.begin(), nameIndex.end(), e, nameEntryLess), e);
+  });
+}
+
+void nameIndexRemove(UserRef u)
+{
+  nameKeys(u->second.folded, [u](uint16_t off) {
+    NameEntry e{u, off};
+    auto it = std::lower_bound(nameIndex.begin(), nameIndex.end(), e, nameEntryLess);
+    if (it != nameIndex.end() && it->user == u && it->offset == off) nameIndex.erase(it);
+  });
+}
+
+// Rebuild from userCache in one sort (caller holds AccessLock)
+void nameIndexBuild()
+{
+  nameIndex.clear();
+  for (auto it = userCache.begin(); it != userCache.end(); ++it) {
+    nameKeys(it->second.folded, [it](uint16_t off) { nameIndex.push_back(NameEntry{it, off}); });
+  }
+  std::sort(nameIndex.begin(), nameIndex.end(), nameEntryLess);
+}
+
+// Up to limit user ids: names with a word starting with the query first,
+// then names containing it anywhere; each user once (caller holds AccessLock)
+std::vector<String> nameSearch(const String &query, size_t limit)
+{
+  std::vector<String> out;
+  String q = foldName(query);
+  if (!q.length()) return out;
+  auto add = [&out](const String &id) {
+    if (std::find(out.begin(), out.end(), id) == out.end()) out.push_back(id);
+  };
+  auto below = [](const NameEntry &e, const char *q) { return strcmp(e.key(), q) < 0; };
+  for (auto it = std::lower_bound(nameIndex.begin(), nameIndex.end(), q.c_str(), below);
+       it != nameIndex.end() && out.size() < limit && strncmp(it->key(), q.c_str(), q.length()) == 0; ++it) {
+    add(it->user->first);
+  }
+  size_t scanned = 0;
+  for (auto it = userCache.begin(); it != userCache.end() && out.size() < limit && scanned < NAME_SCAN_MAX;
+       ++it, ++scanned) {
+    if (strstr(it->second.folded.c_str(), q.c_str())) add(it->first);
+  }
+  return out;
+}
+
+// ------------------ SORTED LISTING ------------------
+// Users are listed in a language-friendly order rather than raw UTF-8 byte
+// order. Every user gets a sort key when the name is stored; comparing two
+// keys byte by byte gives their order, so a listing is a walk over userOrder,
+// which is kept sorted as users are added or renamed.
+//
+// Key = primary 0x01 secondary 0x01 tertiary:
+//   primary    the folded search form (no accents, no case), so "Ärzte"
+//              sorts with "Arzte" as in German dictionary order (DIN
+//              5007-1; phone-book order, DIN 5007-2, would sort it as
+//              "Aerzte"). Scripts follow code point order: Latin, Greek,
+//              Cyrillic, Devanagari, kana (gojūon order), kanji.
+//   secondary  one weight per letter: 2 plain, 3 accented or katakana
+//   tertiary   one weight per letter: 2 lower case, 3 upper case
+// Trailing 2s are dropped from both; 2 being the smallest weight and the
+// separator smaller still, that leaves the order unchanged.
+
+std::vector<UserRef> userOrder; // userCache entries by sortKey, then id
+
+bool cpUpper(uint32_t cp)
+{
+  if (cp < 0x80) return cp >= 'A' && cp <= 'Z';
+  if (cp >= 0xFF21 && cp <= 0xFF3A) return true;
+  if (cp >= 0xC0 && cp <= 0xDE) return cp != 0xD7;
+  if (cp >= 0x100 && cp <= 0x137) return !(cp & 1);
+  if (cp >= 0x139 && cp <= 0x148) return cp & 1;
+  if (cp >= 0x14A && cp <= 0x177) return !(cp & 1);
+  if (cp == 0x178) return true;
+  if (cp >= 0x179 && cp <= 0x17E) return cp & 1;
+  if (cp >= 0x386 && cp <= 0x3AB) return cp != 0x390;
+  return cp >= 0x400 && cp <= 0x42F;
+}
+
+bool cpAccented(uint32_t cp)
+{
+  if (cp >= 0xC0 && cp <= 0x17F) return cp != 0xD7 && cp != 0xF7;
+  if (cp >= 0x386 && cp <= 0x390) return cp != 0x387 && cp != 0x38B && cp != 0x38D;
+  if ((cp >= 0x3AA && cp <= 0x3B0) || (cp >= 0x3CA && cp <= 0x3CE)) return true;
+  if (cp == 0x401 || cp == 0x451) return true;
+  return cp >= 0x30A1 && cp <= 0x30F6;
+}
+
+String collationKey(const String &name)
+{
+  String secondary, tertiary, letter;
+  size_t i = 0;
+  while (i < name.length()) {
+    uint32_t cp = utf8Next(name, i);
+    if (cp >= 0x300 && cp <= 0x36F) {
+      // A combining accent marks the letter before it
+      if (secondary.length()) secondary.setCharAt(secondary.length() - 1, 3);
+      continue;
+    }
+    letter = "";
+    foldCodepoint(cp, letter);
+    if (!letter.length() || letter == " ") continue;
+    secondary += (char)(cpAccented(cp) ? 3 : 2);
+    tertiary += (char)(cpUpper(cp) ? 3 : 2);
+  }
+  while (secondary.endsWith("\x02")) secondary.remove(secondary.length() - 1, 1);
+  while (tertiary.endsWith("\x02")) tertiary.remove(tertiary.length() - 1, 1);
+  return foldName(name) + "\x01" + secondary + "\x01" + tertiary;
+}
+
+bool userOrderLess(const UserRef &a, const UserRef &b)
+{
+  int c = strcmp(a->second.sortKey.c_str(), b->second.sortKey.c_str());
+  return c < 0 || (c == 0 && strcmp(a->first.c_str(), b->first.c_str()) < 0);
+}
+
+// Incremental updates (caller holds AccessLock); remove before changing sortKey
+void userOrderAdd(UserRef u)
+{
+  userOrder.insert(std::lower_bound(userOrder.begin(), userOrder.end(), u, userOrderLess), u);
+}
+
+void userOrderRemove(UserRef u)
+{
+  auto it = std::lower_bound(userOrder.begin(), userOrder.end(), u, userOrderLess);
+  if (it != userOrder.end() && *it == u) userOrder.erase(it);
+}
+
+// Rebuild from userCache in one sort (caller holds AccessLock)
+void userOrderBuild()
+{
+  userOrder.clear();
+  userOrder.reserve(userCache.size());
+  for (auto it = userCache.begin(); it != userCache.end(); ++it) userOrder.push_back(it);
+  std::sort(userOrder.begin(), userOrder.end(), userOrderLess);
+}
+
+// ------------------ CARDS ------------------
+// A user (stable id, name stored once) holds any number of cards. cardIndex
+// maps a packed card UID to its owner's userCache entry, so a scan is one
+// hash lookup and adding or removing a card touches one index entry.
+//
+// Packed key: UID length in the top byte, then the UID bytes. 10-byte UIDs
+// do not fit and keep a 56-bit hash instead; for those the owner's card
+// list is checked on lookup, so a hash collision can never open a door.
+
+std::unordered_map<uint64_t, UserRef> cardIndex;
+
+// Upper-case hex without separators ("04:a1:b2" -> "04A1B2")
+String normalizeCard(const String &card)
+{
+  String out;
+  for (size_t i = 0; i < card.length(); ++i) {
+    if (isxdigit(card[i])) out += (char)toupper(card[i]);
+  }
+  return out;
+}
+
+bool packCard(const String &hex, uint64_t &key)
+{
+  size_t n = hex.length() / 2;
+  if (hex.length() % 2 || n == 0 || n > 10) return false;
+  uint64_t v = 0, h = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < n; ++i) {
+    if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1])) return false;
+    char b[3] = {hex[2 * i], hex[2 * i + 1], 0};
+    uint8_t byte = strtoul(b, NULL, 16);
+    v = v << 8 | byte;
+    h = (h ^ byte) * 1099511628211ULL;
+  }
+  key = (uint64_t)n << 56 | (n <= 7 ? v : h & 0xFFFFFFFFFFFFFFULL);
+  return true;
+}
+
+// Owner of a card, or userCache.end() (caller holds AccessLock)
+UserRef cardOwner(const String &card)
+{
+  uint64_t key;
+  if (!packCard(card, key)) return userCache.end();
+  auto it = cardIndex.find(key);
+  if (it == cardIndex.end()) return userCache.end();
+  const std::vector<String> &cards = it->second->second.cards;
+  if (card.length() > 14 && std::find(cards.begin(), cards.end(), card) == cards.end()) return userCache.end();
+  return it->second;
+}
+
+extern uint32_t wheelNow; // see VISITOR PASSES
+
+// Point a card at u; false if the card is invalid, owned by someone else or
+// u is a pass that has expired (caller holds AccessLock)
+bool cardBind(const String &card, UserRef u)
+{
+  uint64_t key;
+  if (!packCard(card, key)) return false;
+  if (u->second.expires && u->second.expires <= wheelNow) return false;
+  auto res = cardIndex.emplace(key, u);
+  return res.second || res.first->second == u;
+}
+
+void cardUnbind(const String &card)
+{
+  uint64_t key;
+  if (packCard(card, key)) cardIndex.erase(key);
+}
+
+// ------------------ REVOCATION ------------------
+// Cards that must never open a door again, whoever they belong to. The list
+// is a sorted array of packed card keys (see CARDS) behind a Bloom filter:
+// almost every scan is settled by three bit tests, and a filter hit is
+// confirmed by binary search. A hashed 10-byte key that collides can only
+// deny, never grant.
+//
+// The list carries a version. The server pushes deltas from the version the
+// device reports and a full list when they disagree. Stored in REVOKED_FILE,
+// little-endian: magic, version, count, keys (8 bytes each).
+
+const uint32_t REVOKED_MAGIC = 0x31564B52; // "RKV1"
+std::vector<uint64_t> revokedCards;        // sorted packed keys
+uint32_t revokedBloom[REVOKE_BLOOM_BITS / 32];
+uint32_t revocationVersion = 0;
+uint32_t revokedDenials = 0;
+
+// Calls fn with the filter bit positions of a key
+template <class Fn>
+void revokeBloomBits(uint64_t key, Fn fn)
+{
+  uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+  uint32_t h1 = h >> 32, h2 = (uint32_t)h | 1;
+  for (uint32_t i = 0; i < 3; ++i) fn((h1 + i * h2) % REVOKE_BLOOM_BITS);
+}
+
+void revokeBloomBuild()
+{
+  memset(revokedBloom, 0, sizeof(revokedBloom));
+  for (uint64_t key : revokedCards) {
+    revokeBloomBits(key, [](uint32_t b) { revokedBloom[b / 32] |= 1u << (b % 32); });
+  }
+}
+
+// Called on every scan, before the card is looked up (caller holds AccessLock)
+bool cardRevoked(const String &card)
+{
+  uint64_t key;
+  if (!packCard(card, key)) return false;
+  bool maybe = true;
+  revokeBloomBits(key, [&maybe](uint32_t b) { maybe = maybe && (revokedBloom[b / 32] >> (b % 32) & 1); });
+  return maybe && std::binary_search(revokedCards.begin(), revokedCards.end(), key);
+}
+
+bool revocationSave()
+{
+  std::vector<uint8_t> out;
+  auto put = [&out](uint64_t v, int bytes) { for (int i = 0; i < bytes; ++i) out.push_back(v >> (8 * i)); };
+  {
+    AccessLock lock;
+    put(REVOKED_MAGIC, 4);
+    put(revocationVersion, 4);
+    put(revokedCards.size(), 4);
+    for (uint64_t key : revokedCards) put(key, 8);
+  }
+  return writeFileAtomic(REVOKED_FILE, out.data(), out.size());
+}
+
+void revocationBegin()
+{
+  std::unique_ptr<StorageReader> r = storage.openRead(REVOKED_FILE);
+  if (!r) r = storage.openRead((String(REVOKED_FILE) + ".tmp").c_str());
+  uint8_t head[12];
+  if (r && r->read(head, sizeof(head)) == sizeof(head) &&
+      (head[0] | head[1] << 8 | head[2] << 16 | (uint32_t)head[3] << 24) == REVOKED_MAGIC) {
+    uint32_t count = head[8] | head[9] << 8 | head[10] << 16 | (uint32_t)head[11] << 24;
+    AccessLock lock;
+    revocationVersion = head[4] | head[5] << 8 | head[6] << 16 | (uint32_t)head[7] << 24;
+    revokedCards.clear();
+    uint8_t k[8];
+    while (revokedCards.size() < count && r->read(k, sizeof(k)) == sizeof(k)) {
+      uint64_t key = 0;
+      for (int i = 7; i >= 0; --i) key = key << 8 | k[i];
+      revokedCards.push_back(key);
+    }
+    std::sort(revokedCards.begin(), revokedCards.end());
+    revokeBloomBuild();
+  }
+  Serial.printf("[REVOKE] version %u, %u cards\n", revocationVersion, (unsigned)revokedCards.size());
+}
+
+// Apply one change set (caller holds AccessLock). full: cards replace the list
+void revocationApply(bool full, JsonArray add, JsonArray remove)
+{
+  if (full) revokedCards.clear();
+  uint64_t key;
+  for (JsonVariant c : add) {
+    if (!packCard(normalizeCard(c.as<String>()), key)) continue;
+    auto it = std::lower_bound(revokedCards.begin(), revokedCards.end(), key);
+    if (it == revokedCards.end() || *it != key) revokedCards.insert(it, key);
+  }
+  for (JsonVariant c : remove) {
+    if (!packCard(normalizeCard(c.as<String>()), key)) continue;
+    auto it = std::lower_bound(revokedCards.begin(), revokedCards.end(), key);
+    if (it != revokedCards.end() && *it == key) revokedCards.erase(it);
+  }
+  revokeBloomBuild();
+}
+
+// ------------------ VISITOR PASSES ------------------
+// A user with "expires" is a pass. Expiry times sit in a hierarchical timer
+// wheel of 4 levels x 64 slots (1 s, 64 s, ~68 min, ~73 h per slot): a tick
+// handles one slot whatever the number of passes, and an entry moves down a
+// level only when its slot comes round. Expiries beyond the wheel's span
+// (~194 days) wait in the top level and are filed again when reached.
+//
+// An expired pass loses its cards at once, so it can no longer be looked
+// up; the record and its file are removed a few at a time from loop().
+// Changing a pass's expiry leaves the old timer behind; it is ignored when
+// it fires because it no longer matches the user.
+
+const int WHEEL_LEVELS = 4;
+const int WHEEL_BITS = 6;
+const uint32_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+const size_t PASS_REMOVE_PER_POLL = 4;
+
+struct PassTimer {
+  String id;
+  uint32_t expires;
+};
+std::vector<PassTimer> passWheel[WHEEL_LEVELS][WHEEL_SLOTS];
+uint32_t wheelNow = 0;             // last second processed
+std::vector<String> passesExpired; // cards unbound, record not removed yet
+uint32_t passesExpiredTotal = 0;
+
+// File a timer by its distance from wheelNow (caller holds AccessLock)
+void wheelInsert(const String &id, uint32_t expires)
+{
+  if (expires < wheelNow) expires = wheelNow;
+  uint32_t delta = expires - wheelNow;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && delta >= 1u << (WHEEL_BITS * (level + 1))) level++;
+  uint32_t slot = expires >> (WHEEL_BITS * level);
+  if (delta >= 1u << (WHEEL_BITS * WHEEL_LEVELS)) {
+    slot = (wheelNow >> (WHEEL_BITS * level)) - 1; // out of range: the slot cascaded last
+  }
+  passWheel[level][slot & (WHEEL_SLOTS - 1)].push_back(PassTimer{id, expires});
+}
+
+// Schedule a pass; one already due expires on the next tick
+void passSchedule(const String &id, uint32_t expires)
+{
+  wheelInsert(id, std::max(expires, wheelNow + 1));
+}
+
+void passExpire(const PassTimer &t)
+{
+  auto it = userCache.find(t.id);
+  if (it == userCache.end() || it->second.expires != t.expires) return; // stale timer
+  for (const String &card : it->second.cards) cardUnbind(card);
+  passesExpired.push_back(t.id);
+  passesExpiredTotal++;
+  Serial.println("[PASS] Expired: " + t.id);
+}
+
+// Advance the wheel by one second (caller holds AccessLock)
+void wheelTick()
+{
+  uint32_t t = ++wheelNow;
+  // Cascade higher levels whose slot just came round, then fire level 0
+  for (int level = 1; level < WHEEL_LEVELS; ++level) {
+    if (t & ((1u << (WHEEL_BITS * level)) - 1)) break;
+    std::vector<PassTimer> due;
+    due.swap(passWheel[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+    for (const PassTimer &e : due) wheelInsert(e.id, e.expires);
+  }
+  std::vector<PassTimer> due;
+  due.swap(passWheel[0][t & (WHEEL_SLOTS - 1)]);
+  for (const PassTimer &e : due) passExpire(e);
+}
+
+// Refile every pass from userCache, e.g. after loadUsers() or a clock jump
+// (caller holds AccessLock)
+void passRebuild()
+{
+  for (auto &level : passWheel) {
+    for (auto &slot : level) slot.clear();
+  }
+  wheelNow = wallNow();
+  for (auto &kv : userCache) {
+    if (kv.second.expires) passSchedule(kv.first, kv.second.expires);
+  }
+}
+
+// Called from loop(): runs the wheel up to now and removes expired records
+void passPoll()
+{
+  {
+    AccessLock lock;
+    uint32_t now = wallNow();
+    if (now - wheelNow > 3600) passRebuild(); // clock stepped (first SNTP sync)
+    while (wheelNow < now) wheelTick();
+  }
+  for (size_t n = 0; n < PASS_REMOVE_PER_POLL && passesExpired.size(); ++n) {
+    String id = passesExpired.back();
+    passesExpired.pop_back();
+    {
+      AccessLock lock;
+      auto it = userCache.find(id);
+      // Renewed in the meantime?
+      if (it == userCache.end() || !it->second.expires || it->second.expires > wheelNow) continue;
+      presenceSet(it->second, 0, 0);
+      releaseSchedule(it->second.access);
+      // Cards bound since the pass expired must not outlive the record
+      for (const String &card : it->second.cards) {
+        if (cardOwner(card) == it) cardUnbind(card);
+      }
+      nameIndexRemove(it);
+      userOrderRemove(it);
+      userCache.erase(it);
+    }
+    storage.remove((String(USERS_DIR) + "/" + id + ".json").c_str());
+  }
+}
+
+// ------------------ DAILY REPORTS ------------------
+// Per-user aggregates for the current local day, updated on every accepted
+// scan: first and last scan, scan count and accumulated presence (from the
+// OCCUPANCY state). At midnight they are rolled into a compact summary file,
+// so "who was in on day X" never needs the attendance log.
+
+struct DayAggregate {
+  uint32_t first;     // wall time of the first scan today, 0 = none
+  uint32_t last;
+  uint16_t scans;
+  uint32_t presence;  // seconds inside any zone today (closed intervals)
+};
+
+std::map<String, DayAggregate> todayAgg;  // user id -> today's aggregate
+uint32_t aggDay = 0;                      // yyyymmdd that todayAgg belongs to
+bool aggDirty = false;
+time_t aggLastSnapshot = 0;
+
+// Presence seconds from since (clipped to dayStart) up to until
+uint32_t presenceWithin(uint32_t since, time_t dayStart, time_t until)
+{
+  time_t from = std::max((time_t)since, dayStart);
+  return until > from ? until - from : 0;
+}
+
+// Record an accepted scan (caller holds AccessLock). presenceBefore/since are
+// the user's state before the passage.
+void dailyRecord(const String &id, const UserRecord &u, uint8_t presenceBefore, uint32_t since)
+{
+  time_t now = wallNow();
+  DayAggregate &a = todayAgg[id];
+  if (!a.first) a.first = now;
+  a.last = now;
+  a.scans++;
+  if (presenceBefore && !u.presence) a.presence += presenceWithin(since, localDayStart, now);
+  aggDirty = true;
+}
+
+String isoTime(time_t t)
+{
+  if (!t) return "";
+  char buf[24];
+  struct tm tmv;
+  gmtime_r(&t, &tmv);
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tmv);
+  return String(buf);
+}
+
+// Summary CSV for a set of aggregates; openUntil > 0 adds the open presence
+// interval of users still inside up to that time (caller holds AccessLock)
+String dailyCsv(time_t dayStart, time_t openUntil)
+{
+  String out = "\xEF\xBB\xBF" "user,name,first,last,scans,presence_s\r\n";
+  auto row = [&](const String &id, const DayAggregate &a, const UserRecord *u) {
+    uint32_t presence = a.presence;
+    if (openUntil && u && u->presence) presence += presenceWithin(u->presenceSince, dayStart, openUntil);
+    out += csvEsc(id) + "," + csvEsc(u ? u->name : String()) + "," + isoTime(a.first) + "," + isoTime(a.last) + "," +
+           String(a.scans) + "," + String((unsigned long)presence) + "\r\n";
+  };
+  // Sorted by name; users removed since they scanned come last
+  for (UserRef u : userOrder) {
+    auto it = todayAgg.find(u->first);
+    if (it != todayAgg.end()) row(u->first, it->second, &u->second);
+  }
+  for (auto &kv : todayAgg) {
+    if (!userCache.count(kv.first)) row(kv.first, kv.second, NULL);
+  }
+  return out;
+}
+
+// Snapshot today's running totals (raw, for restore after a reboot)
+void dailySnapshot()
+{
+  String snap = "day " + String((unsigned long)aggDay) + "\n";
+  {
+    AccessLock lock;
+    for (auto &kv : todayAgg) {
+      const DayAggregate &a = kv.second;
+      snap += kv.first + " " + String((unsigned long)a.first) + " " + String((unsigned long)a.last) + " " +
+              String(a.scans) + " " + String((unsigned long)a.presence) + "\n";
+    }
+    aggDirty = false;
+  }
+  writeFileAtomic(REPORT_TODAY_FILE, snap);
+  aggLastSnapshot = wallNow();
+}
+
+// Close the day: users still inside get presence up to midnight, the summary
+// file is written and the aggregates start over
+void dailyRollover(uint32_t newDay, time_t midnight)
+{
+  String csv;
+  {
+    AccessLock lock;
+    time_t dayStart = midnight - 86400; // close enough across DST for presence clipping
+    for (auto &kv : userCache) {
+      if (!kv.second.presence) continue;
+      todayAgg[kv.first].presence += presenceWithin(kv.second.presenceSince, dayStart, midnight);
+    }
+    csv = dailyCsv(dayStart, 0);
+    todayAgg.clear();
+  }
+  if (aggDay) {
+    String path = String(REPORTS_DIR) + "/" + String((unsigned long)aggDay) + ".csv";
+    if (!storage.writeFile(path.c_str(), (const uint8_t *)csv.c_str(), csv.length())) {
+      Serial.println("[ERR] Cannot write daily report " + path);
+    }
+  }
+  aggDay = newDay;
+  dailySnapshot();
+}
+
+// Restore today's running totals after a reboot
+void dailyBegin()
+{
+  if (!storage.exists(REPORTS_DIR)) storage.mkdir(REPORTS_DIR);
+  String snap = readWholeFile(REPORT_TODAY_FILE);
+  int start = 0;
+  while (start < (int)snap.length()) {
+    int end = snap.indexOf('\n', start);
+    if (end < 0) break;
+    String line = snap.substring(start, end);
+    start = end + 1;
+    if (line.startsWith("day ")) {
+      aggDay = line.substring(4).toInt();
+      continue;
+    }
+    char id[64];
+    unsigned long first, last, scans, presence;
+    if (sscanf(line.c_str(), "%63s %lu %lu %lu %lu", id, &first, &last, &scans, &presence) != 5) continue;
+    DayAggregate &a = todayAgg[id];
+    a.first = first;
+    a.last = last;
+    a.scans = scans;
+    a.presence = presence;
+  }
+}
+
+// Called from loop(): midnight rollover and periodic snapshots
+void dailyPoll()
+{
+  if (!clockValid()) return;
+  if (aggDay != localDay) {
+    dailyRollover(localDay, localDayStart);
+    return;
+  }
+  if (aggDirty && wallNow() - aggLastSnapshot >= (time_t)REPORT_SNAPSHOT_S) dailySnapshot();
+}
+
+// ------------------ LOG WRITER ------------------
+// Appending ~70 bytes per scan makes the filesystem rewrite a partial page
+// (and its metadata) every time. Records are collected in logBuf and written
+// so that every full write ends exactly on a LOG_PAGE_SIZE boundary of the file.
+// A record is taken whole or not at all: it is copied only if the buffer has
+// room for all of it, and bytes a failed write leaves behind stay buffered
+// for the next attempt, so no partial record ever reaches the file.
+
+const uint32_t LOG_APPEND_FAILED = 0xFFFFFFFF;
+uint8_t logBuf[LOG_PAGE_SIZE + LOG_RECORD_MAX];
+size_t logBufLen = 0;
+uint32_t logFileSize = 0;          // bytes already on flash
+unsigned long logOldestMs = 0;     // when the oldest buffered byte arrived
+volatile uint32_t logDurableSeq = 0; // every record below this seq is on flash
+
+// logBuf and logFileSize are read by web handlers (LogReader) and flushed by
+// loop() while the scan task appends. Recursive: a record is numbered and
+// appended under one lock (see FlashLogSink).
+SemaphoreHandle_t logMutex = NULL;
+struct LogLock {
+  LogLock() { xSemaphoreTakeRecursive(logMutex, portMAX_DELAY); }
+  ~LogLock() { xSemaphoreGiveRecursive(logMutex); }
+};
+
+struct LogWriterStats {
+  uint32_t logicalBytes;     // record bytes accepted
+  uint32_t flashWriteBytes;  // bytes handed to the filesystem
+  uint32_t flashWrites;      // write calls
+  uint32_t pagesProgrammed;  // LOG_PAGE_SIZE pages touched by those writes
+  uint32_t sectorsEntered;   // new erase sectors started (erase estimate)
+  uint32_t encryptUs;        // time spent encrypting flushes
+  uint32_t errors;
+  uint32_t refused;          // records not taken (buffer full after write errors)
+} logStats = {};
+
+// Returns true if a new log was started
+bool logWriterBegin()
+{
+  bool fresh = ensureAttendanceCSV();
+  std::unique_ptr<StorageReader> r = storage.openRead(ATTENDANCE_CSV);
+  logFileSize = r ? r->size() : 0;
+  logDurableSeq = seqNext;
+  return fresh;
+}
+
+// Caller holds LogLock. Writes the first n buffered bytes (default: all).
+void logWriterFlush(size_t n = sizeof(logBuf))
+{
+  n = std::min(n, logBufLen);
+  if (n == 0) return;
+  // Encrypted into a copy: logBuf stays plaintext for LogReader and a retry
+  static uint8_t out[sizeof(logBuf)];
+  memcpy(out, logBuf, n);
+  uint32_t t0 = micros();
+  logCipher.apply(logFileSize, out, n);
+  logStats.encryptUs += micros() - t0;
+  if (!storage.append(ATTENDANCE_CSV, out, n)) {
+    // Keep the data and retry on the next flush
+    logStats.errors++;
+    Serial.println("[ERR] Cannot append to attendance CSV");
+    return;
+  }
+  chainAdd(logBuf, n);
+  uint32_t first = logFileSize, last = logFileSize + n - 1;
+  logStats.flashWriteBytes += n;
+  logStats.flashWrites++;
+  logStats.pagesProgrammed += last / LOG_PAGE_SIZE - first / LOG_PAGE_SIZE + 1;
+  // Sectors the file had started before this write vs. after it
+  logStats.sectorsEntered += last / FLASH_SECTOR_SIZE + 1 - (first + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  logFileSize += n;
+  logBufLen -= n;
+  memmove(logBuf, logBuf + n, logBufLen);
+  if (logBufLen) logOldestMs = millis();
+}
+
+// Buffer one record and write every page it completes. Returns the record's
+// offset in the log, or LOG_APPEND_FAILED if it was refused (too long, or
+// the buffer is still full of data that could not be written).
+uint32_t logWriterAppend(const uint8_t *data, size_t len)
+{
+  LogLock lock;
+  if (len > LOG_RECORD_MAX || logBufLen + len > sizeof(logBuf)) {
+    logStats.refused++;
+    return LOG_APPEND_FAILED;
+  }
+  uint32_t off = logFileSize + logBufLen;
+  logStats.logicalBytes += len;
+  if (logBufLen == 0) logOldestMs = millis();
+  memcpy(logBuf + logBufLen, data, len);
+  logBufLen += len;
+  // Up to the last page boundary inside the buffer; the rest waits
+  size_t cap = LOG_PAGE_SIZE - (logFileSize % LOG_PAGE_SIZE);
+  if (logBufLen >= cap) logWriterFlush(cap + (logBufLen - cap) / LOG_PAGE_SIZE * LOG_PAGE_SIZE);
+  if (LOG_FLUSH_DEADLINE_MS == 0) logWriterFlush();
+  if (logBufLen == 0) logDurableSeq = seqNext;
+  return off;
+}
+
+// Logical size of the log, including buffered records
+uint32_t logEnd()
+{
+  LogLock lock;
+  return logFileSize + logBufLen;
+}
+
+// Called from loop(): writes a partial page once it is old enough
+void logWriterPoll()
+{
+  LogLock lock;
+  if (logBufLen && millis() - logOldestMs >= LOG_FLUSH_DEADLINE_MS) logWriterFlush();
+  if (logBufLen == 0) logDurableSeq = seqNext;
+}
+
+// Random access to the log by byte offset, including records still in logBuf,
+// decrypted. The file is reopened if a flush happened since it was last opened.
+class LogReader {
+public:
+  size_t readAt(uint32_t off, uint8_t *buf, size_t len)
+  {
+    LogLock lock;
+    size_t n = 0;
+    if (off < logFileSize) {
+      if (!r || opened != logFileSize) {
+        r = storage.openRead(ATTENDANCE_CSV);
+        opened = logFileSize;
+      }
+      if (!r || !r->seek(off)) return 0;
+      n = r->read(buf, std::min<size_t>(len, logFileSize - off));
+      logCipher.apply(off, buf, n);
+    }
+    // Continue into the unflushed tail
+    if (n < len && off + n >= logFileSize && off + n - logFileSize < logBufLen) {
+      size_t from = off + n - logFileSize;
+      size_t m = std::min(len - n, logBufLen - from);
+      memcpy(buf + n, logBuf + from, m);
+      n += m;
+    }
+    return n;
+  }
+
+  // The record starting at off, without its line ending
+  bool readLine(uint32_t off, String &line)
+  {
+    line = "";
+    char buf[128];
+    while (line.length() < 1024) {
+      size_t n = readAt(off, (uint8_t *)buf, sizeof(buf));
+      if (n == 0) break;
+      char *nl = (char *)memchr(buf, '\n', n);
+      if (nl) {
+        line.concat(buf, nl - buf);
+        if (line.endsWith("\r")) line.remove(line.length() - 1, 1);
+        return true;
+      }
+      line.concat(buf, n);
+      off += n;
+    }
+    return line.length() > 0;
+  }
+
+private:
+  std::unique_ptr<StorageReader> r;
+  uint32_t opened = 0;
+};
+
+// ------------------ LOG CHAIN ------------------
+// Tamper evidence for the attendance log. Every block the log writer flushes
+// is chained as it is written:
+//   h[i] = SHA-256(h[i-1] || plaintext bytes of block i),  h[-1] = 32 zero bytes
+// and the entry {end offset, h[i]} goes to CHAIN_FILE (36 bytes each: end as
+// uint32 little-endian, then the hash). Offsets count the log's content as
+// downloaded from /files/attendance.csv, without the encryption line. Entries
+// are kept in RAM and saved in batches by the storage worker; whatever the
+// chain does not cover at boot (the header of a new log, entries lost to a
+// reset) is chained then as one block.
+//
+// A chain that reaches past the end of the log means chained bytes are gone.
+// The log and chain are then moved aside together at boot (see
+// CHAIN_BROKEN_PREFIX) and a new log starts. If that cannot be done (no free
+// name, or the chain cannot be read) the chain is latched broken: nothing
+// more is chained or signed, and /api/metrics reports it. Neither case ever
+// restarts the chain over the same log.
+//
+// GET /api/log/chain returns the head {blocks, end, hash} signed with the
+// device's ECDSA P-256 key (made at first boot, kept in NVS). Record the
+// public key when the device is installed: a head is only as good as the key
+// it is checked against. tools/verify_log_chain.py checks a downloaded log,
+// its chain file and a head in one pass over the log.
+
+const size_t CHAIN_ENTRY_BYTES = 36;
+
+struct ChainEntry {
+  uint32_t end; // content offset just past the block
+  uint8_t hash[32];
+};
+
+// Chain state, under LogLock (extended by logWriterFlush)
+uint8_t chainHead[32];
+uint32_t chainBlocks = 0, chainEnd = 0;
+std::vector<ChainEntry> chainPending; // not yet in CHAIN_FILE
+uint32_t chainUs = 0, chainSaveErrors = 0;
+bool chainBroken = false;   // chain and log disagree: nothing is chained or signed
+bool chainMovedAside = false; // this boot moved a log the chain did not match
+
+mbedtls_ecp_group chainGroup;
+mbedtls_mpi chainKey;
+mbedtls_ecp_point chainPublic;
+bool chainKeyLoaded = false;
+String chainPublicHex;
+
+String toHex(const uint8_t *data, size_t len)
+{
+  String out;
+  char byte[3];
+  for (size_t i = 0; i < len; ++i) {
+    sprintf(byte, "%02x", data[i]);
+    out += byte;
+  }
+  return out;
+}
+
+int chainRandom(void *, unsigned char *buf, size_t len)
+{
+  esp_fill_random(buf, len);
+  return 0;
+}
+
+// SHA-256 of a previous chain hash and a block fed in pieces
+class ChainBlock {
+public:
+  explicit ChainBlock(const uint8_t prev[32])
+  {
+    mbedtls_md_init(&ctx);
+    mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&ctx);
+    mbedtls_md_update(&ctx, prev, 32);
+  }
+  ~ChainBlock() { mbedtls_md_free(&ctx); }
+  void add(const uint8_t *data, size_t len) { mbedtls_md_update(&ctx, data, len); }
+  void finish(uint8_t out[32]) { mbedtls_md_finish(&ctx, out); }
+private:
+  mbedtls_md_context_t ctx;
+};
+
+// Caller holds LogLock: chain a block the log writer has just written
+void chainAdd(const uint8_t *data, size_t len)
+{
+  if (chainBroken) return;
+  uint32_t t0 = micros();
+  ChainBlock block(chainHead);
+  block.add(data, len);
+  block.finish(chainHead);
+  chainBlocks++;
+  chainEnd += len;
+  ChainEntry e;
+  e.end = chainEnd;
+  memcpy(e.hash, chainHead, sizeof(e.hash));
+  chainPending.push_back(e);
+  chainUs += micros() - t0;
+}
+
+// Append the pending entries to CHAIN_FILE and report the head they end
+// with. Storage worker (or setup()) only, so saves never interleave.
+bool chainSave(ChainEntry *head = NULL, uint32_t *blocks = NULL)
+{
+  std::vector<ChainEntry> batch;
+  {
+    LogLock lock;
+    batch.swap(chainPending);
+    if (head) {
+      head->end = chainEnd;
+      memcpy(head->hash, chainHead, sizeof(head->hash));
+    }
+    if (blocks) *blocks = chainBlocks;
+  }
+  if (batch.empty()) return true;
+  std::vector<uint8_t> buf(batch.size() * CHAIN_ENTRY_BYTES);
+  uint8_t *p = buf.data();
+  for (const ChainEntry &e : batch) {
+    for (int i = 0; i < 4; ++i) *p++ = e.end >> (8 * i);
+    memcpy(p, e.hash, sizeof(e.hash));
+    p += sizeof(e.hash);
+  }
+  if (storage.append(CHAIN_FILE, buf.data(), buf.size())) return true;
+  LogLock lock;
+  chainPending.insert(chainPending.begin(), batch.begin(), batch.end());
+  chainSaveErrors++;
+  return false;
+}
+
+// Load the signing key from NVS, making one on first boot (before Wi-Fi,
+// hence the bootloader's entropy source)
+void chainKeyBegin()
+{
+  mbedtls_ecp_group_init(&chainGroup);
+  mbedtls_mpi_init(&chainKey);
+  mbedtls_ecp_point_init(&chainPublic);
+  if (mbedtls_ecp_group_load(&chainGroup, MBEDTLS_ECP_DP_SECP256R1) != 0) return;
+  uint8_t d[32], q[65];
+  Preferences prefs;
+  prefs.begin("chain", false);
+  bool ok = prefs.getBytes("d", d, sizeof(d)) == sizeof(d) && prefs.getBytes("q", q, sizeof(q)) == sizeof(q) &&
+            mbedtls_mpi_read_binary(&chainKey, d, sizeof(d)) == 0 &&
+            mbedtls_ecp_point_read_binary(&chainGroup, &chainPublic, q, sizeof(q)) == 0;
+  if (!ok) {
+    size_t qlen = 0;
+    bootloader_random_enable();
+    ok = mbedtls_ecp_gen_keypair(&chainGroup, &chainKey, &chainPublic, chainRandom, NULL) == 0 &&
+         mbedtls_mpi_write_binary(&chainKey, d, sizeof(d)) == 0 &&
+         mbedtls_ecp_point_write_binary(&chainGroup, &chainPublic, MBEDTLS_ECP_PF_UNCOMPRESSED, &qlen, q, sizeof(q)) == 0 &&
+         prefs.putBytes("d", d, sizeof(d)) == sizeof(d) && prefs.putBytes("q", q, sizeof(q)) == sizeof(q);
+    bootloader_random_disable();
+    if (ok) Serial.println("[CHAIN] New signing key");
+  }
+  prefs.end();
+  memset(d, 0, sizeof(d));
+  chainKeyLoaded = ok;
+  chainPublicHex = ok ? toHex(q, sizeof(q)) : String();
+  if (!ok) Serial.println("[ERR] No chain signing key, chain heads are unsigned");
+}
+
+// Last complete entry of CHAIN_FILE; entries = 0 (and a zero entry) without
+// one. False if the file exists but cannot be read.
+bool chainReadLast(ChainEntry &last, uint32_t &entries)
+{
+  memset(&last, 0, sizeof(last));
+  entries = 0;
+  std::unique_ptr<StorageReader> r = storage.openRead(CHAIN_FILE);
+  if (!r) return !storage.exists(CHAIN_FILE);
+  entries = r->size() / CHAIN_ENTRY_BYTES;
+  if (!entries) return true;
+  uint8_t raw[CHAIN_ENTRY_BYTES];
+  if (!r->seek((entries - 1) * CHAIN_ENTRY_BYTES) || r->read(raw, sizeof(raw)) != sizeof(raw)) return false;
+  last.end = raw[0] | raw[1] << 8 | raw[2] << 16 | (uint32_t)raw[3] << 24;
+  memcpy(last.hash, raw + 4, sizeof(last.hash));
+  return true;
+}
+
+// Called by ensureAttendanceCSV() with the log's content length: if the
+// chain runs past it, move log and chain aside and return true. Never
+// overwrites an earlier pair; chainBegin() latches the chain broken instead.
+bool chainSetAside(uint32_t content)
+{
+  ChainEntry last;
+  uint32_t entries;
+  if (!chainReadLast(last, entries) || last.end <= content) return false;
+  String csv, chain;
+  for (int i = 1; i <= CHAIN_BROKEN_MAX && !csv.length(); ++i) {
+    String base = String(CHAIN_BROKEN_PREFIX) + "-" + String(i);
+    if (!storage.exists((base + ".csv").c_str()) && !storage.exists((base + ".chain").c_str())) {
+      csv = base + ".csv";
+      chain = base + ".chain";
+    }
+  }
+  if (!csv.length() || !storage.rename(CHAIN_FILE, chain.c_str())) return false;
+  if (!storage.rename(ATTENDANCE_CSV, csv.c_str())) {
+    storage.rename(chain.c_str(), CHAIN_FILE);
+    return false;
+  }
+  chainMovedAside = true;
+  Serial.printf("[CHAIN] Chain covers %u bytes, the log only %u: both moved to %s\n", (unsigned)last.end,
+                (unsigned)content, csv.c_str());
+  return true;
+}
+
+// Keep the first `entries` of CHAIN_FILE, dropping a torn tail. The file is
+// only replaced once the copy is complete.
+bool chainTruncate(uint32_t entries)
+{
+  String tmp = String(CHAIN_FILE) + ".tmp";
+  std::unique_ptr<StorageReader> r = storage.openRead(CHAIN_FILE);
+  bool ok = r && storage.writeFile(tmp.c_str(), NULL, 0);
+  uint8_t buf[CHAIN_ENTRY_BYTES * 16];
+  for (uint32_t left = entries * CHAIN_ENTRY_BYTES; ok && left > 0;) {
+    size_t n = r->read(buf, std::min<size_t>(sizeof(buf), left));
+    ok = n > 0 && storage.append(tmp.c_str(), buf, n);
+    left -= n;
+  }
+  r.reset();
+  if (!ok) {
+    storage.remove(tmp.c_str());
+    return false;
+  }
+  storage.remove(CHAIN_FILE);
+  return storage.rename(tmp.c_str(), CHAIN_FILE);
+}
+
+// Resume the chain from CHAIN_FILE and chain what it does not cover yet.
+// Called from setup() after logWriterBegin().
+void chainBegin()
+{
+  chainKeyBegin();
+  uint32_t content = logEnd() - logCipher.start;
+  ChainEntry last;
+  uint32_t entries;
+  std::unique_ptr<StorageReader> r = storage.openRead(CHAIN_FILE);
+  size_t size = r ? r->size() : 0;
+  r.reset();
+  memset(chainHead, 0, sizeof(chainHead));
+  if (!chainReadLast(last, entries) || last.end > content) {
+    // Left as found for whoever investigates (see above)
+    chainBroken = true;
+    Serial.println("[ERR] Log chain broken: it does not match the log, chain heads are not signed");
+    return;
+  }
+  chainBlocks = entries;
+  chainEnd = last.end;
+  memcpy(chainHead, last.hash, sizeof(chainHead));
+  if (size != chainBlocks * CHAIN_ENTRY_BYTES && !chainTruncate(chainBlocks)) {
+    chainBroken = true;
+    Serial.println("[ERR] Cannot trim the torn log chain entry, chain heads are not signed");
+    return;
+  }
+  if (chainEnd < content) {
+    LogReader log;
+    ChainBlock block(chainHead);
+    uint8_t buf[256];
+    size_t n;
+    for (uint32_t off = logCipher.start + chainEnd; off < logCipher.start + content; off += n) {
+      n = log.readAt(off, buf, std::min<size_t>(sizeof(buf), logCipher.start + content - off));
+      if (n == 0) break;
+      block.add(buf, n);
+    }
+    LogLock lock;
+    block.finish(chainHead);
+    chainBlocks++;
+    ChainEntry e;
+    e.end = chainEnd = content;
+    memcpy(e.hash, chainHead, sizeof(e.hash));
+    chainPending.push_back(e);
+  }
+  chainSave();
+  Serial.printf("[CHAIN] %u blocks, %u bytes\n", (unsigned)chainBlocks, (unsigned)chainEnd);
+}
+
+// Saved head as signed JSON (storage worker only). The signature is ECDSA
+// P-256 over SHA-256 of
+//   "rfid-log-chain:<device>:<blocks>:<end>:<hash hex>:<signed_at>"
+bool chainSignedHead(String &out)
+{
+  ChainEntry head;
+  uint32_t blocks;
+  if (chainBroken || !chainSave(&head, &blocks)) return false;
+  uint32_t at = wallNow();
+  String hash = toHex(head.hash, sizeof(head.hash));
+  String msg = "rfid-log-chain:" + deviceId + ":" + String(blocks) + ":" + String(head.end) + ":" + hash + ":" + String(at);
+  String sig;
+  if (chainKeyLoaded) {
+    uint8_t digest[32], rs[64];
+    mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t *)msg.c_str(), msg.length(), digest);
+    mbedtls_mpi r, s;
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    if (mbedtls_ecdsa_sign(&chainGroup, &r, &s, &chainKey, digest, sizeof(digest), chainRandom, NULL) == 0 &&
+        mbedtls_mpi_write_binary(&r, rs, 32) == 0 && mbedtls_mpi_write_binary(&s, rs + 32, 32) == 0) {
+      sig = toHex(rs, sizeof(rs));
+    }
+    mbedtls_mpi_free(&r);
+    mbedtls_mpi_free(&s);
+  }
+  DynamicJsonDocument doc(768);
+  doc["device"] = deviceId;
+  doc["blocks"] = blocks;
+  doc["end"] = head.end;
+  doc["hash"] = hash;
+  doc["signed_at"] = at;
+  doc["algorithm"] = "ecdsa-p256-sha256";
+  doc["public_key"] = chainPublicHex;
+  doc["signature"] = sig; // r || s, empty without a key
+  serializeJson(doc, out);
+  return true;
+}
+
+// ------------------ LOG INDEX ------------------
+// Per-user history without scanning the whole log. The log is cut into
+// segments of LOG_SEGMENT_BYTES by file offset and each record belongs to the
+// segment it starts in. Postings (user id -> record offsets) of the open segment
+// live in RAM; once the log moves on they are written once to
+// /idx/<segment>.idx and never change. Everything here can be rebuilt from
+// the log: at boot for missing or damaged files, or on request.
+//
+// Index file, little-endian: magic, segment, user count, then per user in
+// sorted order: length (1 byte), id, offset count (2 bytes), offsets
+// (4 bytes each); the magic again at the end marks a complete file.
+
+typedef std::map<String, std::vector<uint32_t>> Postings;
+const uint32_t INDEX_MAGIC = 0x31584941; // "AIX1"
+Postings activePostings;           // records of activeSegment
+uint32_t activeSegment = 0;
+Postings sealingPostings;          // previous segment until indexPoll() saves it
+int32_t sealingSegment = -1;
+volatile bool indexRebuildPending = false;
+uint32_t indexSegmentsRebuilt = 0;
+uint32_t indexWriteErrors = 0;
+
+String indexPath(uint32_t seg)
+{
+  return String(INDEX_DIR) + "/" + String((unsigned long)seg) + ".idx";
+}
+
+static uint32_t indexGet32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+bool indexWriteSegment(uint32_t seg, const Postings &postings)
+{
+  std::vector<uint8_t> out;
+  auto put32 = [&out](uint32_t v) { for (int i = 0; i < 4; ++i) out.push_back(v >> (8 * i)); };
+  put32(INDEX_MAGIC);
+  put32(seg);
+  put32(postings.size());
+  for (auto &kv : postings) {
+    size_t n = std::min<size_t>(kv.first.length(), 255);
+    out.push_back(n);
+    out.insert(out.end(), kv.first.c_str(), kv.first.c_str() + n);
+    uint16_t count = std::min<size_t>(kv.second.size(), 0xFFFF);
+    out.push_back(count & 0xFF);
+    out.push_back(count >> 8);
+    for (uint16_t i = 0; i < count; ++i) put32(kv.second[i]);
+  }
+  put32(INDEX_MAGIC);
+  String path = indexPath(seg);
+  if (storage.writeFile(path.c_str(), out.data(), out.size())) return true;
+  indexWriteErrors++;
+  Serial.println("[ERR] Cannot write index " + path);
+  return false;
+}
+
+// Header and trailer check; a file cut short by a power loss fails it
+bool indexValid(uint32_t seg)
+{
+  std::unique_ptr<StorageReader> r = storage.openRead(indexPath(seg).c_str());
+  if (!r) return false;
+  size_t size = r->size();
+  uint8_t head[12], tail[4];
+  if (size < sizeof(head) + sizeof(tail) || r->read(head, sizeof(head)) != sizeof(head)) return false;
+  if (!r->seek(size - sizeof(tail)) || r->read(tail, sizeof(tail)) != sizeof(tail)) return false;
+  return indexGet32(head) == INDEX_MAGIC && indexGet32(head + 4) == seg && indexGet32(tail) == INDEX_MAGIC;
+}
+
+// Append id's offsets in a sealed segment to out; false if the file is unusable
+bool indexReadSegment(uint32_t seg, const String &id, std::vector<uint32_t> &out)
+{
+  std::unique_ptr<StorageReader> r = storage.openRead(indexPath(seg).c_str());
+  if (!r) return false;
+  size_t size = r->size();
+  if (size < 16) return false;
+  std::vector<uint8_t> buf(size);
+  if (r->read(buf.data(), size) != size) return false;
+  const uint8_t *p = buf.data(), *end = p + size - 4;
+  if (indexGet32(p) != INDEX_MAGIC || indexGet32(p + 4) != seg || indexGet32(end) != INDEX_MAGIC) return false;
+  uint32_t keys = indexGet32(p + 8);
+  p += 12;
+  for (uint32_t k = 0; k < keys; ++k) {
+    if (p >= end || p + 1 + *p + 2 > end) return false;
+    size_t n = *p++;
+    const uint8_t *key = p;
+    p += n;
+    uint16_t count = p[0] | p[1] << 8;
+    p += 2;
+    if (p + 4 * count > end) return false;
+    if (n == id.length() && memcmp(key, id.c_str(), n) == 0) {
+      for (uint16_t i = 0; i < count; ++i) out.push_back(indexGet32(p + 4 * i));
+      return true;
+    }
+    p += 4 * count;
+  }
+  return true;
+}
+
+// User column of a log record (seq,timestamp,hlc,"card","user",...); false
+// for the header and for unknown cards
+bool logRecordUser(const String &line, String &id)
+{
+  if (!line.length() || line[0] < '0' || line[0] > '9') return false;
+  int p = -1;
+  for (int k = 0; k < 3; ++k) {
+    p = line.indexOf(',', p + 1);
+    if (p < 0) return false;
+  }
+  // Two quoted columns: skip the card, keep the user
+  id = "";
+  int i = p + 1;
+  for (int field = 0; field < 2; ++field) {
+    if (i >= (int)line.length() || line[i] != '"') return false;
+    for (++i; i < (int)line.length(); ++i) {
+      if (line[i] == '"') {
+        if (i + 1 >= (int)line.length() || line[i + 1] != '"') break;
+        ++i; // doubled quote
+      }
+      if (field) id += line[i];
+    }
+    i += 2; // closing quote and comma
+  }
+  return id.length() > 0;
+}
+
+// Add every record starting in [from, to) to postings
+void indexScan(LogReader &log, uint32_t from, uint32_t to, Postings &postings)
+{
+  uint8_t buf[256];
+  // The byte before `from` tells whether a record starts exactly there
+  uint32_t pos = from ? from - 1 : 0;
+  bool lineStart = (from == 0), inRecord = false;
+  uint32_t start = 0;
+  String line, id;
+  size_t n;
+  while ((n = log.readAt(pos, buf, sizeof(buf))) > 0) {
+    for (size_t i = 0; i < n; ++i, ++pos) {
+      if (lineStart) {
+        if (pos >= to) return;
+        lineStart = false;
+        inRecord = pos >= from;
+        start = pos;
+        line = "";
+      }
+      if (buf[i] == '\n') {
+        if (inRecord && logRecordUser(line, id)) postings[id].push_back(start);
+        lineStart = true;
+      } else if (inRecord && line.length() < 128) {
+        line += (char)buf[i];
+      }
+    }
+  }
+}
+
+// Record the log offset of a new record (called before it is appended)
+void indexAdd(const String &id, uint32_t off)
+{
+  AccessLock lock;
+  uint32_t seg = off / LOG_SEGMENT_BYTES;
+  if (seg != activeSegment) {
+    // indexPoll() normally saved the previous one long ago
+    if (sealingSegment >= 0) indexWriteSegment(sealingSegment, sealingPostings);
+    sealingPostings.swap(activePostings);
+    activePostings.clear();
+    sealingSegment = activeSegment;
+    activeSegment = seg;
+  }
+  // A rebuild may already have picked this record up from the log
+  std::vector<uint32_t> &offs = activePostings[id];
+  if (offs.empty() || offs.back() < off) offs.push_back(off);
+}
+
+// Offsets of a user's most recent records (at most limit), oldest first. Sealed
+// segments are read newest first and only until enough records are found.
+std::vector<uint32_t> indexLookup(const String &id, size_t limit)
+{
+  std::vector<uint32_t> out;
+  int32_t seg;
+  {
+    AccessLock lock;
+    auto take = [&](const Postings &p) {
+      auto it = p.find(id);
+      if (it != p.end()) out.insert(out.begin(), it->second.begin(), it->second.end());
+    };
+    take(activePostings);
+    seg = activeSegment;
+    if (sealingSegment >= 0) {
+      take(sealingPostings);
+      seg = sealingSegment;
+    }
+  }
+  while (--seg >= 0 && out.size() < limit) {
+    std::vector<uint32_t> found;
+    indexReadSegment(seg, id, found);
+    out.insert(out.begin(), found.begin(), found.end());
+  }
+  if (out.size() > limit) out.erase(out.begin(), out.end() - limit);
+  return out;
+}
+
+void indexClear()
+{
+  std::vector<String> files;
+  storage.list(INDEX_DIR, [&files](const char *path, size_t) { files.push_back(path); });
+  for (auto &f : files) storage.remove(f.c_str());
+}
+
+// Check the sealed segments, rebuilding missing or damaged ones from the log,
+// and load the open segment into RAM. freshLog: the log was just started, so
+// any index files left over belong to the previous one.
+void indexBegin(bool freshLog)
+{
+  if (!storage.exists(INDEX_DIR)) storage.mkdir(INDEX_DIR);
+  if (freshLog) indexClear();
+  LogReader log;
+  uint32_t total = logEnd();
+  uint32_t open = total / LOG_SEGMENT_BYTES;
+  for (uint32_t s = 0; s < open; ++s) {
+    if (indexValid(s)) continue;
+    Postings p;
+    indexScan(log, s * LOG_SEGMENT_BYTES, (s + 1) * LOG_SEGMENT_BYTES, p);
+    if (indexWriteSegment(s, p)) indexSegmentsRebuilt++;
+  }
+  Postings p;
+  indexScan(log, open * LOG_SEGMENT_BYTES, total, p);
+  // Scans logged meanwhile; their indexAdd() calls skip what we find here
+  indexScan(log, total, logEnd(), p);
+  AccessLock lock;
+  activePostings.swap(p);
+  activeSegment = open;
+  sealingPostings.clear();
+  sealingSegment = -1;
+  Serial.printf("[INDEX] %u sealed segments, %u rebuilt\n", open, indexSegmentsRebuilt);
+}
+
+// Called from loop(): saves a sealed segment, or rebuilds everything on request
+void indexPoll()
+{
+  if (indexRebuildPending) {
+    indexRebuildPending = false;
+    indexSegmentsRebuilt = 0;
+    indexClear();
+    indexBegin(false);
+    return;
+  }
+  Postings sealed;
+  int32_t seg;
+  {
+    AccessLock lock;
+    if (sealingSegment < 0) return;
+    seg = sealingSegment;
+    sealed = sealingPostings;
+  }
+  // Written from a copy, without the lock, so scans are not held up.
+  // On failure the file is rebuilt at the next boot.
+  indexWriteSegment(seg, sealed);
+  AccessLock lock;
+  if (sealingSegment != seg) return; // indexAdd() already wrote it
+  sealingPostings.clear();
+  sealingSegment = -1;
+}
+
+// ------------------ SD MIRROR ------------------
+#if ENABLE_SD
+// The SD card is a redundant copy of the primary log, written by its own task.
+// Records carry their sequence number, so the mirror can tell what the card
+// is missing and replay it from the primary log after an overflow or a card swap.
+
+struct SdMirrorItem {
+  uint32_t seq;
+  char line[SD_LINE_MAX];
+};
+
+QueueHandle_t sdQueue = NULL;
+volatile uint32_t sdNextSeq = 0;       // records below this are on the card
+volatile uint32_t sdQueueHighWater = 0;
+volatile uint32_t sdSkipped = 0;       // records not queued (full queue / long line)
+volatile uint32_t sdReplayed = 0;      // records copied from the primary log
+volatile bool sdMounted = false;
+File sdLog;
+
+// Sequence number of the last record in a log, false if it has none
+bool lastLogSeq(StorageReader *r, uint32_t &seq)
+{
+  if (!r) return false;
+  char buf[SD_LINE_MAX + 2];
+  size_t size = r->size();
+  size_t from = size > sizeof(buf) - 1 ? size - (sizeof(buf) - 1) : 0;
+  r->seek(from);
+  size_t n = r->read((uint8_t *)buf, sizeof(buf) - 1);
+  buf[n] = '\0';
+  while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) buf[--n] = '\0';
+  char *line = strrchr(buf, '\n');
+  line = line ? line + 1 : buf;
+  if (*line < '0' || *line > '9') return false; // header only
+  seq = strtoul(line, NULL, 10);
+  return true;
+}
+
+// Called from SdMirrorSink: never blocks. A record that cannot be queued is
+// not lost, the mirror task sees the gap and replays it from the primary log.
+void sdMirrorEnqueue(uint32_t seq, const String &line)
+{
+  if (!sdQueue) return;
+  SdMirrorItem item;
+  if (line.length() >= sizeof(item.line)) {
+    sdSkipped++;
+    return;
+  }
+  item.seq = seq;
+  memcpy(item.line, line.c_str(), line.length() + 1);
+  if (xQueueSend(sdQueue, &item, 0) != pdTRUE) {
+    sdSkipped++;
+    return;
+  }
+  uint32_t depth = uxQueueMessagesWaiting(sdQueue);
+  if (depth > sdQueueHighWater) sdQueueHighWater = depth;
+}
+
+void sdUnmount()
+{
+  if (sdLog) sdLog.close();
+  SD.end();
+  sdMounted = false;
+  Serial.println("[SD] Card removed or failed");
+}
+
+// Mount the card and work out how far its copy of the log got
+bool sdMount()
+{
+  if (!SD.begin(SD_CS_PIN)) return false;
+  if (!SD.exists(ATTENDANCE_CSV)) {
+    File f = SD.open(ATTENDANCE_CSV, FILE_WRITE);
+    if (!f) { SD.end(); return false; }
+    const uint8_t bom[3] = {0xEF, 0xBB, 0xBF};
+    f.write(bom, 3);
+    f.println(LOG_HEADER);
+    f.close();
+  }
+  FsReader card(SD.open(ATTENDANCE_CSV, FILE_READ));
+  uint32_t last;
+  sdNextSeq = lastLogSeq(&card, last) ? last + 1 : 0;
+  sdLog = SD.open(ATTENDANCE_CSV, FILE_APPEND);
+  if (!sdLog) { SD.end(); return false; }
+  sdMounted = true;
+  Serial.printf("[SD] Card mounted, mirror at seq %u\n", (unsigned)sdNextSeq);
+  return true;
+}
+
+// Copy records with sdNextSeq <= seq < upto from the primary log to the card.
+// Returns false if the card failed or the primary log does not have them yet.
+bool sdReplay(uint32_t upto)
+{
+  LogReader src; // decrypts
+  uint32_t off = logCipher.start;
+  uint32_t durable = logDurableSeq; // everything below this is on flash
+  bool header = true;
+  String line;
+  uint8_t buf[256];
+  size_t n;
+  while (sdNextSeq < upto && (n = src.readAt(off, buf, sizeof(buf))) > 0) {
+    off += n;
+    for (size_t i = 0; i < n && sdNextSeq < upto; ++i) {
+      if (buf[i] != '\n') {
+        if (!header && buf[i] != '\r') line += (char)buf[i];
+        continue;
+      }
+      if (header) { header = false; continue; }
+      uint32_t seq = strtoul(line.c_str(), NULL, 10);
+      if (seq >= sdNextSeq && seq < upto) {
+        if (sdLog.println(line) != line.length() + 2) {
+          sdUnmount();
+          return false;
+        }
+        sdNextSeq = seq + 1;
+        sdReplayed++;
+      }
+      line = "";
+    }
+  }
+  sdLog.flush();
+  // Sequence numbers skipped by a reboot never appear in the log
+  if (durable >= upto && sdNextSeq < upto) sdNextSeq = upto;
+  return sdNextSeq >= upto;
+}
+
+void sdMirrorTask(void *)
+{
+  SdMirrorItem item;
+  bool pending = false;
+  for (;;) {
+    if (!sdMounted && !sdMount()) {
+      vTaskDelay(pdMS_TO_TICKS(SD_RETRY_MS));
+      continue;
+    }
+    if (!pending) {
+      if (xQueueReceive(sdQueue, &item, pdMS_TO_TICKS(SD_RETRY_MS)) != pdTRUE) {
+        // Idle: catch up anything the queue dropped while it was full
+        if (sdNextSeq < logDurableSeq) sdReplay(logDurableSeq);
+        continue;
+      }
+      pending = true;
+    }
+    if (item.seq < sdNextSeq) { pending = false; continue; } // already replayed
+    if (item.seq > sdNextSeq && !sdReplay(item.seq)) {
+      vTaskDelay(pdMS_TO_TICKS(SD_RETRY_MS));
+      continue;
+    }
+    if (sdLog.println(item.line) != strlen(item.line) + 2) {
+      sdUnmount();
+      continue;
+    }
+    sdNextSeq = item.seq + 1;
+    pending = false;
+    if (uxQueueMessagesWaiting(sdQueue) == 0) sdLog.flush();
+  }
+}
+
+void startSdMirror()
+{
+  sdQueue = xQueueCreate(SD_QUEUE_DEPTH, sizeof(SdMirrorItem));
+  if (!sdQueue) {
+    Serial.println("[ERR] SD mirror queue allocation failed");
+    return;
+  }
+  startTask(sdMirrorTask, "sdmirror", 4096, SD_TASK);
+}
+#endif
+
+// Attendance CSV record, without line ending. method = "rfid" or "web"
+// etc.; id is empty for unknown cards.
+String attendanceRecord(uint32_t seq, uint64_t hlc, const String &card, const String &id, const String &name, const String &method)
+{
+  return String((unsigned long)seq) + "," + nowTimestamp() + "," + hlcToString(hlc) + "," +
+         csvEsc(card) + "," + csvEsc(id) + "," + csvEsc(name) + "," + csvEsc(method);
+}
+
+// Log attendance (append a record to the CSV); returns its offset in the
+// log, or LOG_APPEND_FAILED if the record was not taken
+uint32_t logAttendance(const String &line)
+{
+  String rec = line + "\r\n";
+  uint32_t off = logWriterAppend((const uint8_t *)rec.c_str(), rec.length());
+  if (off == LOG_APPEND_FAILED) Serial.println("[ERR] Not logged: " + line);
+  else Serial.println("[LOG] " + line);
+  return off;
+}
+
+// Utility: write a user JSON to flash: /users/<id>.json
+bool writeUserToFS(const String &id, const JsonDocument &doc)
+{
+  String path = String(USERS_DIR) + "/" + id + ".json";
+  String out;
+  if (serializeJson(doc, out) == 0) return false;
+  return storage.writeFile(path.c_str(), (const uint8_t *)out.c_str(), out.length());
+}
+
+// Rewrite a user's file with a new card list, keeping the other fields
+bool saveUserCards(const String &id, const std::vector<String> &cards)
+{
+  DynamicJsonDocument doc(1024);
+  if (deserializeJson(doc, readWholeFile((String(USERS_DIR) + "/" + id + ".json").c_str()))) return false;
+  JsonArray arr = doc.createNestedArray("cards");
+  for (const String &c : cards) arr.add(c);
+  return writeUserToFS(id, doc);
+}
+
+// Put a parsed user document ({"id", "name", "cards": [...], ...}) into
+// userCache, precomputing its access. Cards held by someone else are skipped.
+void cacheUser(JsonDocument &doc)
+{
+  AccessLock lock;
+  String id = doc["id"].as<String>();
+  auto it = userCache.find(id);
+  bool known = it != userCache.end();
+  String oldName = known ? it->second.name : String();
+  if (!known) {
+    it = userCache.emplace(id, UserRecord()).first;
+    it->second.access = ACCESS_ALWAYS;
+  }
+  UserRecord &u = it->second;
+  String name = doc["name"].as<String>();
+  resolveUserRefs(doc, u);
+  uint32_t expires = doc["expires"] | 0;
+  if (expires != u.expires) {
+    u.expires = expires;
+    if (expires && !usersLoading) passSchedule(id, expires);
+  }
+  std::vector<String> cards;
+  for (JsonVariant c : doc["cards"].as<JsonArray>()) {
+    String card = normalizeCard(c.as<String>());
+    if (std::find(cards.begin(), cards.end(), card) != cards.end()) continue;
+    if (cardBind(card, it)) cards.push_back(card);
+    else Serial.println("[USER] Card " + card + " of " + id + " is invalid or taken, skipped");
+  }
+  for (const String &card : u.cards) {
+    if (std::find(cards.begin(), cards.end(), card) == cards.end()) cardUnbind(card);
+  }
+  u.cards.swap(cards);
+  if (known && oldName == name) return;
+  if (known && !usersLoading) {
+    nameIndexRemove(it);
+    userOrderRemove(it);
+  }
+  u.name = name;
+  u.folded = foldName(name);
+  u.sortKey = collationKey(name);
+  if (!usersLoading) {
+    nameIndexAdd(it);
+    userOrderAdd(it);
+  }
+}
+
+// Apply a changed ACCESS_FILE to the loaded users. The rules and every
+// user's references are read from flash before taking AccessLock, so scans
+// only wait for the swap and the recompile.
+void accessReload()
+{
+  AccessConfig cfg;
+  if (!parseAccessConfig(readWholeFile(ACCESS_FILE), cfg)) {
+    Serial.println("[ACCESS] Invalid access file, keeping the current rules");
+    return;
+  }
+  std::map<String, UserRefs> refs;
+  storage.list(USERS_DIR, [&refs](const char *p, size_t) {
+    String path(p);
+    if (!path.endsWith(".json")) return;
+    DynamicJsonDocument doc(1024);
+    if (deserializeJson(doc, readWholeFile(path.c_str())) || !doc["id"].is<const char *>()) return;
+    refs[doc["id"].as<String>()] = userRefs(doc);
+  });
+  AccessLock lock;
+  // A user whose file could not be read keeps the references they had
+  for (auto &kv : userCache) {
+    if (!refs.count(kv.first)) refs[kv.first] = userRefs(kv.second);
+  }
+  installAccessConfig(cfg);
+  for (auto &kv : userCache) resolveUserRefs(refs[kv.first], kv.second);
+  Serial.printf("[ACCESS] Rules reloaded, %u users recompiled\n", (unsigned)userCache.size());
+}
+
+// Load all users from /users into userCache
+void loadUsers()
+{
+  AccessLock lock;
+  userOrder.clear();
+  cardIndex.clear();
+  userCache.clear();
+  nameIndex.clear();
+  if (!loadAccessConfig(readWholeFile(ACCESS_FILE))) Serial.println("[ACCESS] Invalid access file, access rules disabled");
+  if (!storage.exists(USERS_DIR)) {
+    Serial.println("[WARN] No users directory");
+    return;
+  }
+  usersLoading = true;
+  std::vector<std::pair<String, String>> migrated; // path, new contents
+  storage.list(USERS_DIR, [&migrated](const char *p, size_t) {
+    String path(p);
+    if (!path.endsWith(".json")) return;
+    String body = readWholeFile(path.c_str());
+    DynamicJsonDocument doc(1024);
+    DeserializationError err = deserializeJson(doc, body);
+    if (!err) {
+      if (!doc["id"].is<const char *>() && doc["uid"].is<const char *>()) {
+        // Pre-id file: the card becomes the id, so presence and reports carry over
+        String card = doc["uid"].as<String>();
+        doc["id"] = card;
+        doc.remove("uid");
+        doc.createNestedArray("cards").add(card);
+        String out;
+        serializeJson(doc, out);
+        migrated.push_back(std::make_pair(path, out));
+      }
+      cacheUser(doc);
+      Serial.println("[USER] Loaded: " + doc["id"].as<String>() + " -> " + doc["name"].as<String>());
+    }
+  });
+  usersLoading = false;
+  passRebuild();
+  // Rewritten after the listing, not while iterating the directory
+  for (auto &m : migrated) {
+    if (!storage.writeFile(m.first.c_str(), (const uint8_t *)m.second.c_str(), m.second.length())) {
+      Serial.println("[ERR] Cannot migrate " + m.first);
+    }
+  }
+  nameIndexBuild();
+  userOrderBuild();
+}
+
+// ------------------ SCAN PIPELINE ------------------
+// The pipeline templates are in scan_pipeline.h; the firmware's event and
+// stage policies are below and in RFID HANDLING.
+
+struct ScanEvent {
+  String card, id, name, result;
+  bool granted;
+  uint32_t seq;  // set by FlashLogSink
+  uint64_t hlc;  // set by FlashLogSink
+  String line;   // attendance CSV record, set by FlashLogSink
+  bool logged;   // the record is in the log, set by FlashLogSink
+  uint32_t readUs; // micros() when the card was read
+  ScanEvent() : name("(unknown)"), result("denied"), granted(false), seq(0), hlc(0), logged(false), readUs(0) {}
+  static uint32_t nowUs() { return micros(); }
+};
+
+// Latency distribution in fixed buckets (upper bounds in us). Written by
+// one task; readers may see a sample half-added, which only skews a report.
+const uint32_t LATENCY_BUCKETS_US[] = {250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, UINT32_MAX};
+const size_t LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS_US) / sizeof(LATENCY_BUCKETS_US[0]);
+
+struct LatencyHistogram {
+  uint32_t counts[LATENCY_BUCKET_COUNT];
+  uint32_t n, maxUs;
+  uint64_t sumUs;
+
+  void add(uint32_t us)
+  {
+    size_t b = 0;
+    while (us > LATENCY_BUCKETS_US[b]) b++;
+    counts[b]++;
+    n++;
+    sumUs += us;
+    maxUs = std::max(maxUs, us);
+  }
+
+  // Upper bound of the bucket the q-th fraction of samples falls in
+  uint32_t percentile(float q) const
+  {
+    uint32_t want = (uint32_t)(q * n + 0.5f), seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKET_COUNT; ++b) {
+      seen += counts[b];
+      if (seen >= want && seen) return std::min(LATENCY_BUCKETS_US[b], maxUs);
+    }
+    return 0;
+  }
+};
+
+LatencyHistogram scanLatency;  // real cards
+LatencyHistogram probeLatency; // ENABLE_JITTER_PROBE scans
+
+// Feedback policy wrapper: records scan-to-feedback latency into *Hist
+template <class Feedback, LatencyHistogram *Hist>
+struct TimedFeedback {
+  Feedback inner;
+  void signal(const ScanEvent &e)
+  {
+    Hist->add(micros() - e.readUs);
+    inner.signal(e);
+  }
+};
+
+// ------------------ AUTH ------------------
+// Tokens are "<role>.<expires>.<mac>": role "viewer" or "admin", expiry in
+// Unix seconds, and the first AUTH_MAC_BYTES of HMAC-SHA256 over
+// "<role>.<expires>" in hex. The HMAC key is made at first boot and kept in
+// NVS, not on the filesystem that /files serves; POST /api/auth/rotate
+// replaces it, which logs everyone out. An open websocket is not closed
+// when its token expires.
+//
+// Dashboards poll with the same token over and over, so tokens that passed
+// the HMAC check are kept in a small cache (AUTH_CACHE_SIZE, least recently
+// used out) and a token found there skips the HMAC. MACs, cached or
+// computed, are compared in constant time. Only used on the AsyncTCP task,
+// so there is no lock.
+
+#if ENABLE_AUTH
+enum AuthRole { ROLE_NONE, ROLE_VIEWER, ROLE_ADMIN };
+const char *AUTH_ROLE_NAMES[] = {"none", "viewer", "admin"};
+const size_t AUTH_MAC_BYTES = 16;
+const char *AUTH_COOKIE = "rfid_session";
+
+uint8_t authSecret[32];
+
+struct VerifiedToken {
+  uint8_t role; // ROLE_NONE = free entry
+  uint32_t expires;
+  uint8_t mac[AUTH_MAC_BYTES];
+  uint32_t usedMs; // LRU order
+};
+VerifiedToken authCache[AUTH_CACHE_SIZE];
+uint32_t authIssued = 0, authVerified = 0, authCacheHits = 0, authRejected = 0;
+
+// No early exit, so the time taken says nothing about where a guess first
+// goes wrong
+bool constantTimeEquals(const uint8_t *a, const uint8_t *b, size_t n)
+{
+  uint8_t diff = 0;
+  for (size_t i = 0; i < n; ++i) diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+void authHmac(const char *msg, size_t len, uint8_t out[32])
+{
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), authSecret, sizeof(authSecret),
+                  (const uint8_t *)msg, len, out);
+}
+
+void authNewSecret()
+{
+  Preferences prefs;
+  esp_fill_random(authSecret, sizeof(authSecret));
+  prefs.begin("auth", false);
+  prefs.putBytes("secret", authSecret, sizeof(authSecret));
+  prefs.end();
+  memset(authCache, 0, sizeof(authCache));
+}
+
+// Load the key from NVS, or make one. Call with Wi-Fi up: only then is
+// esp_fill_random() fed by the radio's entropy.
+void authBegin()
+{
+  Preferences prefs;
+  prefs.begin("auth", true);
+  size_t got = prefs.getBytes("secret", authSecret, sizeof(authSecret));
+  prefs.end();
+  if (got == sizeof(authSecret)) return;
+  authNewSecret();
+  Serial.println("[AUTH] New token key made, earlier tokens are invalid");
+}
+
+String authIssue(AuthRole role, uint32_t expires)
+{
+  String payload = String(AUTH_ROLE_NAMES[role]) + "." + String((unsigned long)expires);
+  uint8_t mac[32];
+  authHmac(payload.c_str(), payload.length(), mac);
+  char hex[AUTH_MAC_BYTES * 2 + 1];
+  for (size_t i = 0; i < AUTH_MAC_BYTES; ++i) sprintf(hex + i * 2, "%02x", mac[i]);
+  authIssued++;
+  return payload + "." + hex;
+}
+
+// Role a token grants: ROLE_NONE if it is missing, malformed, forged or expired
+AuthRole authVerify(const String &token)
+{
+  if (token.length() == 0) return ROLE_NONE;
+  int a = token.indexOf('.'), b = a < 0 ? -1 : token.indexOf('.', a + 1);
+  AuthRole role = ROLE_NONE;
+  uint32_t expires = 0;
+  uint8_t mac[AUTH_MAC_BYTES];
+  if (b > 0 && token.length() == b + 1 + AUTH_MAC_BYTES * 2) {
+    String name = token.substring(0, a);
+    role = name == AUTH_ROLE_NAMES[ROLE_ADMIN] ? ROLE_ADMIN : name == AUTH_ROLE_NAMES[ROLE_VIEWER] ? ROLE_VIEWER : ROLE_NONE;
+    expires = strtoul(token.c_str() + a + 1, NULL, 10);
+    // One spelling per token, so the cache cannot be hit by another one
+    if (token.substring(a + 1, b) != String((unsigned long)expires)) role = ROLE_NONE;
+    const char *hex = token.c_str() + b + 1;
+    for (size_t i = 0; i < AUTH_MAC_BYTES && role != ROLE_NONE; ++i) {
+      char byte[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+      if (!isxdigit(byte[0]) || !isxdigit(byte[1])) role = ROLE_NONE;
+      mac[i] = strtoul(byte, NULL, 16);
+    }
+  }
+  if (role == ROLE_NONE || (time_t)expires <= wallNow()) {
+    authRejected++;
+    return ROLE_NONE;
+  }
+  uint32_t now = millis();
+  VerifiedToken *lru = &authCache[0];
+  for (VerifiedToken &e : authCache) {
+    if (e.role == role && e.expires == expires && constantTimeEquals(e.mac, mac, AUTH_MAC_BYTES)) {
+      e.usedMs = now;
+      authCacheHits++;
+      return role;
+    }
+    if (lru->role == ROLE_NONE) continue; // a free entry beats any used one
+    if (e.role == ROLE_NONE || (int32_t)(e.usedMs - lru->usedMs) < 0) lru = &e;
+  }
+  uint8_t expected[32];
+  authHmac(token.c_str(), b, expected);
+  if (!constantTimeEquals(expected, mac, AUTH_MAC_BYTES)) {
+    authRejected++;
+    return ROLE_NONE;
+  }
+  authVerified++;
+  lru->role = role;
+  lru->expires = expires;
+  memcpy(lru->mac, mac, AUTH_MAC_BYTES);
+  lru->usedMs = now;
+  return role;
 }
 
-// Load all users from /users into userCache
-void loadUsers()
+// The token from "Authorization: Bearer" or the session cookie (browsers
+// send it with websocket upgrades too)
+String authToken(AsyncWebServerRequest *request)
 {
-  userCache.clear();
-  File root = SPIFFS.open(USERS_DIR);
-  if (!root) {
-    Serial.println("[WARN] No users directory");
-    return;
+  if (request->hasHeader("Authorization")) {
+    String v = request->getHeader("Authorization")->value();
+    if (v.startsWith("Bearer ")) return v.substring(7);
   }
-  File file = root.openNextFile();
-  while (file) {
-    String name = file.name();
-    if (name.endsWith(".json")) {
-      File u = SPIFFS.open(name);
-      if (u) {
-        size_t sz = u.size();
-        std::unique_ptr<char[]> buf(new char[sz + 1]);
-        u.readBytes(buf.get(), sz);
-        buf[sz] = '\0';
-        DynamicJsonDocument doc(512);
-        DeserializationError err = deserializeJson(doc, buf.get());
-        if (!err) {
-          String uid = doc["uid"].as<String>();
-          String uname = doc["name"].as<String>();
-          userCache[uid] = uname;
-          Serial.println("[USER] Loaded: " + uid + " -> " + uname);
-        }
-        u.close();
-      }
+  if (request->hasHeader("Cookie")) {
+    String cookies = "; " + request->getHeader("Cookie")->value();
+    String key = String("; ") + AUTH_COOKIE + "=";
+    int at = cookies.indexOf(key);
+    if (at >= 0) {
+      at += key.length();
+      int end = cookies.indexOf(';', at);
+      return cookies.substring(at, end < 0 ? cookies.length() : end);
     }
-    file = root.openNextFile();
   }
+  return String();
 }
 
+// Second handler on the server, after the memory gate: answers 401 to any
+// request whose token does not grant the role it needs (viewer to GET,
+// admin for the rest) and lets the others through to the routes. The page
+// itself and the login are open.
+//
+// A rejected token is a guess like a wrong password, so it takes a token
+// from the client's RATE_LOGIN bucket. Once that is empty the client gets
+// 429 without its token being checked, so a right guess is not told apart
+// from a wrong one until the bucket refills.
+class AuthGate : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest *request) override
+  {
+    const String &url = request->url();
+    if (url == "/" || url == "/api/auth/token") return false;
+    if (!rateHasToken(request->client()->remoteIP(), RATE_LOGIN)) return true;
+    AuthRole need = request->method() == HTTP_GET ? ROLE_VIEWER : ROLE_ADMIN;
+    return authVerify(authToken(request)) < need;
+  }
+  void handleRequest(AsyncWebServerRequest *request) override
+  {
+    if (!rateCheck(request, RATE_LOGIN)) return;
+    AsyncWebServerResponse *res = request->beginResponse(401, "text/plain", "Login required (admin to make changes)");
+    res->addHeader("WWW-Authenticate", "Bearer");
+    request->send(res);
+  }
+};
+AuthGate authGate;
+#endif
+
 // ------------------ WEB HANDLERS ------------------
 
 // Serve a minimal index.html with JS to add users and show websocket events
@@ -209,70 +3952,854 @@ const char index_html[] PROGMEM = R"rawliteral(
 </head>
 <body>
 <h2>ESP32 RFID - Unicode Attendance</h2>
+<div id="login" hidden>
+  <h3>Log in</h3>
+  <label>Password: <input id="pw" type="password" /></label>
+  <button onclick="login()">Log in</button>
+  <span id="loginres"></span>
+</div>
 <div>
   <h3>Add User</h3>
-  <label>UID (hex): <input id="uid" /></label>
+  <label>Card UID (hex): <input id="uid" /></label>
+  <label>User id (optional, to add a card to an existing user): <input id="uidx" /></label>
   <label>Name (Unicode): <input id="name" /></label>
+  <label>Visitor pass, hours valid (optional): <input id="hours" type="number" min="1" /></label>
   <button onclick="addUser()">Add User</button>
   <div id="addres"></div>
 </div>
+<div>
+  <h3>Find User</h3>
+  <label>Name: <input id="q" oninput="findUser()" autocomplete="off" /></label>
+  <ul id="found"></ul>
+</div>
+<div>
+  <h3>Occupancy</h3>
+  <div id="occ">-</div>
+</div>
 <div>
   <h3>Live Events</h3>
   <ul id="events"></ul>
 </div>
 <script>
-let ws = new WebSocket('ws://' + location.host + '/ws');
+let ws
+function connect(){
+ws = new WebSocket('ws://' + location.host + '/ws');
 ws.onmessage = (evt)=>{
-  try{ let d = JSON.parse(evt.data); let el = document.createElement('li'); el.textContent = '['+d.timestamp+'] '+d.uid+' - '+d.name+' ('+d.result+')'; document.getElementById('events').prepend(el);}catch(e){console.log(e)}
+  try{ let d = JSON.parse(evt.data);
+  if(d.type==='occupancy'){showOcc(d.zones);return}
+  let el = document.createElement('li'); el.textContent = '['+(d.timestamp||d.seq)+'] '+d.card+' - '+(d.name||d.user||'?')+' ('+d.result+')'; document.getElementById('events').prepend(el);}catch(e){console.log(e)}
+}
+}
+function showOcc(z){document.getElementById('occ').textContent=z.map((n,i)=>'zone '+i+': '+n).filter((t,i)=>z[i]).join(', ')||'nobody inside'}
+function start(){
+  fetch('/api/occupancy').then(r=>{
+    document.getElementById('login').hidden = r.status!==401;
+    if(r.ok){connect(); return r.json().then(d=>showOcc(d.zones))}})
+}
+function login(){
+  fetch('/api/auth/token', {method:'POST', body: JSON.stringify({password:document.getElementById('pw').value, role:'admin'})})
+    .then(r=>{if(r.ok)start(); else document.getElementById('loginres').textContent='Login failed'})
+}
+start()
+let findSeq=0
+function findUser(){
+  let q=document.getElementById('q').value.trim(), n=++findSeq, ul=document.getElementById('found');
+  if(!q){ul.innerHTML='';return}
+  fetch('/api/users/search?q='+encodeURIComponent(q)).then(r=>r.json()).then(list=>{
+    if(n!==findSeq)return; ul.innerHTML='';
+    list.forEach(u=>{let li=document.createElement('li'); li.textContent=u.name+' ('+u.id+')'; ul.appendChild(li)})})
 }
 function addUser(){
   let uid = document.getElementById('uid').value.trim();
+  let id = document.getElementById('uidx').value.trim();
   let name = document.getElementById('name').value.trim();
-  if(!uid||!name){document.getElementById('addres').textContent='UID and Name required';return}
-  fetch('/adduser', {method:'POST', body: JSON.stringify({uid:uid,name:name})}).then(r=>r.text()).then(t=>document.getElementById('addres').textContent=t)
+  if(!(uid||id)||!name){document.getElementById('addres').textContent='UID and Name required';return}
+  let hours = parseInt(document.getElementById('hours').value);
+  let body = {uid:uid,name:name}; if(id) body.id = id;
+  if(hours>0) body.expires = Math.floor(Date.now()/1000)+hours*3600;
+  fetch('/adduser', {method:'POST', body: JSON.stringify(body)}).then(r=>r.text()).then(t=>document.getElementById('addres').textContent=t)
 }
 </script>
 </body>
 </html>
 )rawliteral";
 
-// Add user POST handler
+// Collect a request body that may arrive in several chunks (up to maxLen).
+// Returns true once complete; the buffer lives in request->_tempObject and is
+// freed with the request.
+bool collectBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total, size_t maxLen)
+{
+  if (total > maxLen) {
+    if (index == 0) request->send(413, "text/plain", "Body too large");
+    return false;
+  }
+  if (index == 0) {
+    request->_tempObject = malloc(total + 1);
+    if (!request->_tempObject) {
+      request->send(503, "text/plain", "Out of memory");
+      return false;
+    }
+  }
+  if (!request->_tempObject) return false;
+  memcpy((uint8_t *)request->_tempObject + index, data, len);
+  if (index + len < total) return false;
+  ((char *)request->_tempObject)[total] = '\0';
+  return true;
+}
+
+// User ids name files: letters, digits, '-' and '_' only
+bool validUserId(const String &id)
+{
+  if (id.length() == 0 || id.length() > 32) return false;
+  for (size_t i = 0; i < id.length(); ++i) {
+    if (!isalnum(id[i]) && id[i] != '-' && id[i] != '_') return false;
+  }
+  return true;
+}
+
+// Add user POST handler: {"id", "name", "cards": [...], "expires"} or, from the form,
+// {"uid": card, "name"} (id defaults to the card). Without "cards" the
+// user's existing cards are kept and "uid" is added to them. An existing
+// user's file is updated, not replaced: fields the request leaves out are
+// kept and null removes one (see mergeUserFields).
 void handleAddUser(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
 {
-  // data is raw body
-  DynamicJsonDocument doc(512);
-  DeserializationError err = deserializeJson(doc, data, len);
-  if (err) {
+  if (!collectBody(request, data, len, index, total, 2048)) return;
+  std::shared_ptr<DynamicJsonDocument> req(new DynamicJsonDocument(std::max<size_t>(512, total * 2)));
+  JsonDocument &doc = *req;
+  if (deserializeJson(doc, (const char *)request->_tempObject)) {
     request->send(400, "text/plain", "Invalid JSON");
     return;
   }
-  String uid = doc["uid"].as<String>();
+  String card = normalizeCard(doc["uid"].as<String>());
+  String id = doc["id"].is<const char *>() ? doc["id"].as<String>() : card;
   String name = doc["name"].as<String>();
-  if (uid.length() == 0 || name.length() == 0) {
+  if (id.length() == 0 || name.length() == 0) {
     request->send(400, "text/plain", "Missing fields");
     return;
   }
-  // save
-  if (!writeUserToFS(uid, name)) {
-    request->send(500, "text/plain", "Failed to save user");
+  if (!validUserId(id)) {
+    request->send(400, "text/plain", "Invalid id");
+    return;
+  }
+  std::vector<String> cards;
+  if (doc["cards"].is<JsonArray>()) {
+    for (JsonVariant c : doc["cards"].as<JsonArray>()) cards.push_back(normalizeCard(c.as<String>()));
+  } else {
+    AccessLock lock;
+    auto it = userCache.find(id);
+    if (it != userCache.end()) cards = it->second.cards;
+    if (card.length() && std::find(cards.begin(), cards.end(), card) == cards.end()) cards.push_back(card);
+  }
+  {
+    AccessLock lock;
+    for (const String &c : cards) {
+      uint64_t key;
+      UserRef owner = cardOwner(c);
+      if (!packCard(c, key) || (owner != userCache.end() && owner->first != id)) {
+        request->send(409, "text/plain", "Card " + c + " is invalid or belongs to another user");
+        return;
+      }
+    }
+  }
+  // Merge into the stored file on the storage worker; the cache is updated
+  // once the file is written
+  std::shared_ptr<String> json(new String());
+  storageSubmit(request, [id, cards, req, json]() {
+      String path = String(USERS_DIR) + "/" + id + ".json";
+      DynamicJsonDocument user(1024);
+      if (deserializeJson(user, readWholeFile(path.c_str()))) user.clear(); // new user
+      mergeUserFields(user, *req);
+      user["id"] = id;
+      JsonArray arr = user.createNestedArray("cards");
+      for (const String &c : cards) arr.add(c);
+      if (serializeJson(user, *json) == 0) return false;
+      return storage.writeFile(path.c_str(), (const uint8_t *)json->c_str(), json->length());
+    }, [id, name, json](bool ok) {
+      if (!ok) return;
+      DynamicJsonDocument user(1024);
+      deserializeJson(user, *json);
+      cacheUser(user);
+      Serial.println("[WEB] Added user: " + id + " -> " + name);
+    }, [](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(200, "text/plain", "User saved");
+      else request->send(500, "text/plain", "Failed to save user");
+    });
+}
+
+// Runtime counters as JSON
+void handleMetrics(AsyncWebServerRequest *request)
+{
+  DynamicJsonDocument doc(8192);
+  doc["uptime_s"] = millis() / 1000;
+  doc["free_heap"] = ESP.getFreeHeap();
+  doc["device"] = deviceId;
+  JsonObject clock = doc.createNestedObject("clock");
+  clock["source"] = TIME_SOURCE_NAMES[clockSource];
+  clock["now"] = nowTimestamp();
+  clock["next_seq"] = seqNext;
+  clock["hlc"] = hlcToString(hlcLast);
+  clock["hlc_rejected"] = hlcRejected;
+  JsonObject access = doc.createNestedObject("access");
+  access["users"] = userCache.size();
+  access["cards"] = cardIndex.size();
+  access["revocation_version"] = revocationVersion;
+  access["revoked"] = revokedCards.size();
+  access["revoked_denials"] = revokedDenials;
+  access["passes_expired"] = passesExpiredTotal;
+  access["distinct_schedules"] = scheduleLive;
+  access["schedule_denials"] = scheduleDenials;
+  access["door_denials"] = doorDenials;
+  access["groups"] = groupDefs.size();
+  access["door"] = DOOR_ID;
+  access["passback_violations"] = passbackViolations;
+  JsonObject log = doc.createNestedObject("log");
+  log["buffered"] = logBufLen;
+  log["logical_bytes"] = logStats.logicalBytes;
+  log["flash_write_bytes"] = logStats.flashWriteBytes;
+  log["flash_writes"] = logStats.flashWrites;
+  log["pages_programmed"] = logStats.pagesProgrammed;
+  log["sector_erases_est"] = logStats.sectorsEntered;
+  log["write_errors"] = logStats.errors;
+  log["refused"] = logStats.refused;
+  log["encrypted"] = logCipher.on;
+  log["encrypt_us"] = logStats.encryptUs;
+  // Flash bytes programmed per logical byte; ~LOG_PAGE_SIZE/record size without coalescing
+  log["write_amplification"] = logStats.logicalBytes ? (float)logStats.pagesProgrammed * LOG_PAGE_SIZE / logStats.logicalBytes : 0;
+  JsonObject chain = doc.createNestedObject("chain");
+  {
+    LogLock lock;
+    chain["blocks"] = chainBlocks;
+    chain["end"] = chainEnd;
+    chain["pending"] = chainPending.size();
+  }
+  chain["hash_us"] = chainUs;
+  chain["save_errors"] = chainSaveErrors;
+  chain["signing_key"] = chainKeyLoaded;
+  chain["broken"] = chainBroken;
+  chain["moved_aside"] = chainMovedAside;
+  JsonObject index = doc.createNestedObject("index");
+  index["segment"] = activeSegment;
+  index["segment_users"] = activePostings.size();
+  index["rebuilt"] = indexSegmentsRebuilt;
+  index["write_errors"] = indexWriteErrors;
+  JsonObject latency = doc.createNestedObject("scan_latency");
+  auto hist = [&latency](const char *key, const LatencyHistogram &h) {
+    JsonObject o = latency.createNestedObject(key);
+    o["count"] = h.n;
+    o["mean_us"] = h.n ? (uint32_t)(h.sumUs / h.n) : 0;
+    o["p50_us"] = h.percentile(0.5f);
+    o["p99_us"] = h.percentile(0.99f);
+    o["max_us"] = h.maxUs;
+    JsonArray buckets = o.createNestedArray("buckets");
+    for (size_t b = 0; b < LATENCY_BUCKET_COUNT; ++b) {
+      JsonArray kv = buckets.createNestedArray();
+      kv.add(LATENCY_BUCKETS_US[b] == UINT32_MAX ? 0 : LATENCY_BUCKETS_US[b]); // 0 = above the last bound
+      kv.add(h.counts[b]);
+    }
+  };
+  hist("cards", scanLatency);
+#if ENABLE_JITTER_PROBE
+  hist("probe", probeLatency);
+#endif
+  JsonObject memory = doc.createNestedObject("memory");
+  memory["level"] = MEMORY_LEVELS[memLevel].name;
+  memory["free_heap"] = ESP.getFreeHeap();
+  memory["largest_block"] = ESP.getMaxAllocHeap();
+  memory["min_free_heap"] = ESP.getMinFreeHeap();
+  memory["transitions"] = memTransitions;
+  memory["ws_pushes_dropped"] = wsPushesDropped;
+  JsonArray recent = memory.createNestedArray("recent");
+  for (uint32_t i = memTransitions > MEM_HISTORY ? memTransitions - MEM_HISTORY : 0; i < memTransitions; ++i) {
+    const MemTransition &t = memHistory[i % MEM_HISTORY];
+    JsonObject o = recent.createNestedObject();
+    o["at_s"] = t.atS;
+    o["from"] = MEMORY_LEVELS[t.from].name;
+    o["to"] = MEMORY_LEVELS[t.to].name;
+    o["free_heap"] = t.freeHeap;
+    o["largest_block"] = t.largestBlock;
+  }
+  JsonObject admission = doc.createNestedObject("admission");
+  admission["flash_busy_pct"] = flashBusyPct;
+  for (int c = 0; c < ADMIT_CLASSES; ++c) {
+    JsonObject o = admission.createNestedObject(ADMISSION_CLASS_NAMES[c]);
+    o["admitted"] = admitCount[c];
+    o["shed_queue"] = shedCount[c][SHED_QUEUE];
+    o["shed_heap"] = shedCount[c][SHED_HEAP];
+    o["shed_flash"] = shedCount[c][SHED_FLASH];
+    o["shed_memory"] = shedCount[c][SHED_MEMORY];
+  }
+#if ENABLE_AUTH
+  JsonObject auth = doc.createNestedObject("auth");
+  auth["issued"] = authIssued;
+  auth["verified"] = authVerified;
+  auth["cache_hits"] = authCacheHits;
+  auth["rejected"] = authRejected;
+#endif
+  JsonObject rate = doc.createNestedObject("rate_limit");
+  rate["evictions"] = rateEvictions;
+  for (int l = 0; l < RATE_LIMITS; ++l) {
+    JsonObject o = rate.createNestedObject(RATE_LIMIT_TABLE[l].name);
+    o["per_s"] = RATE_LIMIT_TABLE[l].perSecond;
+    o["burst"] = RATE_LIMIT_TABLE[l].burst;
+    o["allowed"] = rateAllowed[l];
+    o["limited"] = rateLimited[l];
+  }
+  JsonObject worker = doc.createNestedObject("storage_worker");
+  worker["queued"] = storageQueue ? (uint32_t)uxQueueMessagesWaiting(storageQueue) : 0;
+  worker["queue_high_water"] = storageStats.highWater;
+  worker["jobs"] = storageStats.jobs;
+  worker["failed"] = storageStats.failed;
+  worker["refused"] = storageStats.refused;
+  worker["abandoned"] = storageStats.abandoned;
+  worker["max_wait_ms"] = storageStats.maxWaitMs;
+  worker["max_run_ms"] = storageStats.maxRunMs;
+  std::vector<TaskStats> stats;
+  xSemaphoreTake(schedStatsMutex, portMAX_DELAY);
+  stats = schedStats;
+  xSemaphoreGive(schedStatsMutex);
+  JsonArray tasks = doc.createNestedArray("tasks");
+  for (const TaskStats &t : stats) {
+    JsonObject o = tasks.createNestedObject();
+    o["name"] = t.name;
+    o["period_ms"] = t.period;
+    o["runs"] = t.runs;
+    o["overruns"] = t.overruns;
+    o["skipped"] = t.skipped;
+    o["max_late_ms"] = t.maxLateMs;
+    o["max_run_ms"] = t.maxRunMs;
+  }
+#if ENABLE_SD
+  JsonObject sd = doc.createNestedObject("sd");
+  sd["mounted"] = (bool)sdMounted;
+  sd["queued"] = sdQueue ? (uint32_t)uxQueueMessagesWaiting(sdQueue) : 0;
+  sd["queue_high_water"] = (uint32_t)sdQueueHighWater;
+  sd["skipped"] = (uint32_t)sdSkipped;
+  sd["replayed"] = (uint32_t)sdReplayed;
+  sd["lag"] = logDurableSeq > sdNextSeq ? logDurableSeq - sdNextSeq : 0;
+#endif
+  String out;
+  serializeJson(doc, out);
+  request->send(200, "application/json", out);
+}
+
+#if ENABLE_AUTH
+// Log in: {"password": ADMIN_PASSWORD, "role": "viewer" (default) or
+// "admin", "ttl_s": lifetime}. Answers {"token", "role", "expires"} and
+// sets the session cookie for the web page. The password is compared by
+// HMAC, so the time taken does not depend on the guess, not even its length.
+void handleLogin(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (!collectBody(request, data, len, index, total, 256)) return;
+  DynamicJsonDocument doc(256);
+  if (deserializeJson(doc, (const char *)request->_tempObject)) {
+    request->send(400, "text/plain", "Invalid JSON");
+    return;
+  }
+  const char *password = doc["password"] | "";
+  uint8_t given[32], expected[32];
+  authHmac(password, strlen(password), given);
+  authHmac(ADMIN_PASSWORD, strlen(ADMIN_PASSWORD), expected);
+  if (!constantTimeEquals(given, expected, sizeof(given))) {
+    request->send(401, "text/plain", "Wrong password");
+    return;
+  }
+  AuthRole role = strcmp(doc["role"] | "viewer", "admin") == 0 ? ROLE_ADMIN : ROLE_VIEWER;
+  uint32_t ttl = std::min<uint32_t>(doc["ttl_s"] | AUTH_TOKEN_TTL_S, AUTH_TOKEN_MAX_TTL_S);
+  uint32_t expires = wallNow() + ttl;
+  String token = authIssue(role, expires);
+  AsyncWebServerResponse *res = request->beginResponse(200, "application/json",
+      "{\"token\":\"" + token + "\",\"role\":\"" + AUTH_ROLE_NAMES[role] + "\",\"expires\":" + String((unsigned long)expires) + "}");
+  res->addHeader("Set-Cookie", String(AUTH_COOKIE) + "=" + token + "; Path=/; Max-Age=" + String(ttl) + "; HttpOnly; SameSite=Strict");
+  request->send(res);
+}
+#endif
+
+// Replace the access rules (schedules, groups, holidays). Users are
+// recompiled by loop() so scans never see a half-built table.
+void handleAccessUpload(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (!collectBody(request, data, len, index, total, 16384)) return;
+  String body = (const char *)request->_tempObject;
+  DynamicJsonDocument doc(std::max<size_t>(2048, body.length() * 2));
+  if (deserializeJson(doc, body)) {
+    request->send(400, "text/plain", "Invalid JSON");
+    return;
+  }
+  for (JsonPair kv : doc["schedules"].as<JsonObject>()) {
+    ScheduleBits b;
+    if (!compileSchedule(kv.value().as<JsonObject>(), b)) {
+      request->send(400, "text/plain", String("Invalid schedule: ") + kv.key().c_str());
+      return;
+    }
+  }
+  storageSubmit(request, [body]() { return writeFileAtomic(ACCESS_FILE, body); }, [](bool ok) {
+      if (ok) accessReloadPending = true;
+    }, [](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(202, "text/plain", "Access rules saved");
+      else request->send(500, "text/plain", "Failed to save access rules");
+    });
+}
+
+// Create or update one group: {"name": "staff", "schedule": "office", "doors": [0, 1]}.
+// Saved into ACCESS_FILE; only the group's members are recompiled.
+void handleGroupUpdate(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (!collectBody(request, data, len, index, total, 1024)) return;
+  DynamicJsonDocument def(1024);
+  if (deserializeJson(def, (const char *)request->_tempObject) || !def["name"].is<const char *>()) {
+    request->send(400, "text/plain", "Invalid JSON");
+    return;
+  }
+  String name = def["name"].as<String>();
+  {
+    AccessLock lock;
+    if (findGroup(name) < 0 && groupDefs.size() >= MAX_GROUPS) {
+      request->send(409, "text/plain", "Too many groups");
+      return;
+    }
+  }
+  DynamicJsonDocument g(512);
+  if (def["schedule"].is<const char *>()) g["schedule"] = def["schedule"];
+  if (def["doors"].is<JsonArray>()) g["doors"] = def["doors"];
+  String group;
+  serializeJson(g, group);
+  // Read-modify-write of ACCESS_FILE on the worker, which also orders it
+  // after any access upload queued before it
+  storageSubmit(request, [name, group]() {
+      String body = readWholeFile(ACCESS_FILE);
+      DynamicJsonDocument doc(std::max<size_t>(2048, body.length() * 2 + 512));
+      if (body.length() && deserializeJson(doc, body)) return false;
+      JsonObject groups = doc["groups"].is<JsonObject>() ? doc["groups"].as<JsonObject>() : doc.createNestedObject("groups");
+      DynamicJsonDocument g(512);
+      deserializeJson(g, group);
+      groups[name] = g.as<JsonObject>();
+      String out;
+      serializeJson(doc, out);
+      return writeFileAtomic(ACCESS_FILE, out);
+    }, [name, group](bool ok) {
+      if (!ok) return;
+      DynamicJsonDocument g(512);
+      deserializeJson(g, group);
+      updateGroup(name, g.as<JsonObject>());
+    }, [](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(200, "text/plain", "Group saved");
+      else request->send(500, "text/plain", "Failed to save group");
+    });
+}
+
+// Give a user another card: {"id": "...", "card": "04A1B2C3"}
+void handleCardAdd(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (!collectBody(request, data, len, index, total, 256)) return;
+  DynamicJsonDocument doc(256);
+  if (deserializeJson(doc, (const char *)request->_tempObject)) {
+    request->send(400, "text/plain", "Invalid JSON");
+    return;
+  }
+  String id = doc["id"].as<String>();
+  String card = normalizeCard(doc["card"].as<String>());
+  std::vector<String> cards;
+  {
+    AccessLock lock;
+    auto it = userCache.find(id);
+    if (it == userCache.end()) {
+      request->send(404, "text/plain", "No such user");
+      return;
+    }
+    uint64_t key;
+    UserRef owner = cardOwner(card);
+    if (!packCard(card, key) || (owner != userCache.end() && owner != it)) {
+      request->send(409, "text/plain", "Card is invalid or belongs to another user");
+      return;
+    }
+    cards = it->second.cards;
+    if (std::find(cards.begin(), cards.end(), card) == cards.end()) cards.push_back(card);
+  }
+  // Bound only once saved, so a card the client is told was not added never opens the door
+  std::shared_ptr<bool> bound(new bool(false));
+  storageSubmit(request, [id, cards]() { return saveUserCards(id, cards); }, [id, card, bound](bool ok) {
+      if (!ok) return;
+      AccessLock lock;
+      auto it = userCache.find(id);
+      if (it == userCache.end() || !cardBind(card, it)) return;
+      std::vector<String> &mine = it->second.cards;
+      if (std::find(mine.begin(), mine.end(), card) == mine.end()) mine.push_back(card);
+      *bound = true;
+    }, [bound](AsyncWebServerRequest *request, bool ok) {
+      if (!ok) request->send(500, "text/plain", "Failed to save user");
+      else if (!*bound) request->send(409, "text/plain", "Card was taken, or the user removed or expired, meanwhile");
+      else request->send(200, "text/plain", "Card added");
+    });
+}
+
+// Take a card away from whoever holds it: DELETE /api/cards?card=04A1B2C3
+void handleCardRemove(AsyncWebServerRequest *request)
+{
+  if (!request->hasParam("card")) {
+    request->send(400, "text/plain", "card required");
+    return;
+  }
+  String card = normalizeCard(request->getParam("card")->value());
+  String id;
+  std::vector<String> cards;
+  {
+    AccessLock lock;
+    UserRef it = cardOwner(card);
+    if (it == userCache.end()) {
+      request->send(404, "text/plain", "Unknown card");
+      return;
+    }
+    cardUnbind(card);
+    std::vector<String> &mine = it->second.cards;
+    mine.erase(std::remove(mine.begin(), mine.end(), card), mine.end());
+    id = it->first;
+    cards = mine;
+  }
+  storageSubmit(request, [id, cards]() { return saveUserCards(id, cards); }, NULL, [id](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(200, "text/plain", "Card removed from " + id);
+      else request->send(500, "text/plain", "Failed to save user");
+    });
+}
+
+// Revocation push. Delta: {"from": 41, "version": 42, "add": [..], "remove": [..]},
+// accepted only if "from" is our version (else 409 with ours, so the server
+// can send the whole list). Full: {"version": 42, "full": true, "add": [..]}.
+void handleRevocations(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (!collectBody(request, data, len, index, total, 16384)) return;
+  DynamicJsonDocument doc(std::max<size_t>(1024, total * 2));
+  if (deserializeJson(doc, (const char *)request->_tempObject) || !doc["version"].is<uint32_t>()) {
+    request->send(400, "text/plain", "Invalid JSON");
+    return;
+  }
+  bool full = doc["full"] | false;
+  uint32_t version = doc["version"];
+  {
+    AccessLock lock;
+    if (!full && (!doc["from"].is<uint32_t>() || doc["from"].as<uint32_t>() != revocationVersion)) {
+      request->send(409, "application/json", "{\"version\":" + String(revocationVersion) + "}");
+      return;
+    }
+    revocationApply(full, doc["add"].as<JsonArray>(), doc["remove"].as<JsonArray>());
+    revocationVersion = version;
+  }
+  // In effect now; the reply waits until the list is on flash
+  storageSubmit(request, revocationSave, NULL, [version](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(200, "application/json", "{\"version\":" + String(version) + "}");
+      else request->send(500, "text/plain", "Failed to save revocations");
+    });
+}
+
+// HLC sync exchange: POST {"hlc":"<hex>"} merges the caller's clock and
+// returns ours; GET just returns ours. Collectors call this on every sync.
+void handleHlc(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (!collectBody(request, data, len, index, total, 128)) return;
+  DynamicJsonDocument doc(128);
+  if (deserializeJson(doc, (const char *)request->_tempObject) || !doc["hlc"].is<const char *>()) {
+    request->send(400, "text/plain", "Invalid JSON");
+    return;
+  }
+  uint64_t ours = hlcMerge(strtoull(doc["hlc"].as<const char *>(), NULL, 16));
+  request->send(200, "application/json", "{\"device\":\"" + deviceId + "\",\"hlc\":\"" + hlcToString(ours) + "\"}");
+}
+
+// Zone totals, plus who is inside when ?list=1 (optionally only ?zone=n):
+// answers an evacuation roll call without reading the attendance log.
+void handleOccupancy(AsyncWebServerRequest *request)
+{
+  bool list = request->hasParam("list");
+  int zone = request->hasParam("zone") ? request->getParam("zone")->value().toInt() : -1;
+  AsyncResponseStream *res = request->beginResponseStream("application/json");
+  AccessLock lock;
+  res->printf("{\"door\":%u,\"zone\":%u,\"direction\":\"%s\",\"zones\":[", DOOR_ID, DOOR_ZONE,
+              DOOR_DIRECTION_NAMES[DOOR_DIRECTION]);
+  for (uint8_t z = 0; z < MAX_ZONES; ++z) res->printf("%s%u", z ? "," : "", zoneOccupancy[z]);
+  res->print("]");
+  if (list) {
+    res->print(",\"inside\":[");
+    bool first = true;
+    for (auto &kv : userCache) {
+      const UserRecord &u = kv.second;
+      if (!u.presence || (zone >= 0 && u.presence != zone + 1)) continue;
+      DynamicJsonDocument item(256);
+      item["id"] = kv.first;
+      item["name"] = u.name;
+      item["zone"] = u.presence - 1;
+      item["since"] = u.presenceSince;
+      if (!first) res->print(",");
+      serializeJson(item, *res);
+      first = false;
+    }
+    res->print("]");
+  }
+  res->print("}");
+  request->send(res);
+}
+
+// Content type for a file under /files
+String contentTypeFor(const String &path)
+{
+  if (path.endsWith(".csv")) return "text/csv; charset=utf-8";
+  if (path.endsWith(".json")) return "application/json";
+  if (path.endsWith(".html")) return "text/html; charset=utf-8";
+  if (path.endsWith(".log") || path.endsWith(".txt")) return "text/plain; charset=utf-8";
+  return "application/octet-stream";
+}
+
+// Send a flash file without reading flash on the network task. The worker
+// opens the file and reads one chunk ahead; the response callback copies
+// out of that chunk and answers RESPONSE_TRY_AGAIN while the worker is
+// reading the next one, or while the memory governor has downloads paused.
+// Encrypted logs are decrypted by the worker as it reads.
+void streamFile(AsyncWebServerRequest *request, const String &path, const String &type)
+{
+  struct Stream {
+    std::unique_ptr<StorageReader> reader; // used on the worker only
+    LogCipher cipher;
+    uint32_t pos;                          // file offset of the next read
+    size_t size;
+    uint8_t buf[1024];
+    size_t len, used;
+    volatile bool reading;
+  };
+  std::shared_ptr<Stream> st(new Stream());
+  auto fill = [st]() {
+    st->len = st->reader->read(st->buf, sizeof(st->buf));
+    st->cipher.apply(st->pos, st->buf, st->len);
+    st->pos += st->len;
+    st->used = 0;
+    __sync_synchronize(); // buf before the flag, for the other core
+    st->reading = false;
+    return st->len > 0;
+  };
+  storageSubmit(request, [st, path, fill]() {
+      st->reader = storage.openRead(path.c_str());
+      if (!st->reader) return false;
+      st->cipher.load(*st->reader);
+      st->pos = st->cipher.start;
+      st->size = st->reader->size() - st->cipher.start;
+      fill();
+      return true;
+    }, NULL, [st, type, fill](AsyncWebServerRequest *request, bool ok) {
+      if (!ok) {
+        request->send(404, "text/plain", "Not found");
+        return;
+      }
+      request->send(request->beginResponse(type, st->size, [st, fill](uint8_t *out, size_t maxLen, size_t) -> size_t {
+        if (st->reading || memLevel >= MEM_LOW) return RESPONSE_TRY_AGAIN;
+        if (st->used == st->len) {
+          if (st->len == 0) return 0; // read error or file shrank
+          st->reading = true;
+          if (!storageSubmit(NULL, fill, NULL, NULL)) st->reading = false;
+          return RESPONSE_TRY_AGAIN;
+        }
+        size_t n = std::min(maxLen, st->len - st->used);
+        memcpy(out, st->buf + st->used, n);
+        st->used += n;
+        return n;
+      }));
+    });
+}
+
+// Calendar check for a yyyymmdd day
+bool validDay(uint32_t day)
+{
+  static const uint8_t MONTH_DAYS[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  uint32_t y = day / 10000, m = day / 100 % 100, d = day % 100;
+  if (y < 1970 || y > 9999 || m < 1 || m > 12 || d < 1 || d > MONTH_DAYS[m - 1]) return false;
+  return m != 2 || d < 29 || (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0));
+}
+
+// Daily summary as CSV: ?date=YYYY-MM-DD (default today). Today is rendered
+// from RAM including open presence intervals; past days are stored files.
+// 404 for a day with no aggregate, e.g. today before the clock was ever set.
+void handleDailyReport(AsyncWebServerRequest *request)
+{
+  uint32_t day = localDay;
+  if (request->hasParam("date")) {
+    int y, m, d;
+    if (sscanf(request->getParam("date")->value().c_str(), "%d-%d-%d", &y, &m, &d) != 3 || y < 0 || y > 9999 || m < 0 || m > 99 || d < 0 || d > 99) {
+      request->send(400, "text/plain", "date must be YYYY-MM-DD");
+      return;
+    }
+    day = y * 10000 + m * 100 + d;
+  }
+  if (!validDay(day)) {
+    request->send(400, "text/plain", day ? "Invalid date" : "Clock not set, pass ?date=YYYY-MM-DD");
+    return;
+  }
+  if (aggDay && day == aggDay) {
+    String csv;
+    {
+      AccessLock lock;
+      csv = dailyCsv(localDayStart, wallNow());
+    }
+    request->send(200, "text/csv; charset=utf-8", csv);
+    return;
+  }
+  String path = String(REPORTS_DIR) + "/" + String((unsigned long)day) + ".csv";
+  streamFile(request, path, "text/csv; charset=utf-8");
+}
+
+// One user's scans (any of their cards) as CSV: ?id=, most recent ?limit
+// (default 100) in log order.
+// Only the user's own records are read, located through the log index.
+void handleUserHistory(AsyncWebServerRequest *request)
+{
+  if (!request->hasParam("id")) {
+    request->send(400, "text/plain", "id required");
+    return;
+  }
+  String id = request->getParam("id")->value();
+  long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : 100;
+  if (limit <= 0 || limit > 1000) limit = 1000;
+  std::shared_ptr<String> csv(new String(String("\xEF\xBB\xBF") + LOG_HEADER + "\r\n"));
+  storageSubmit(request, [id, limit, csv]() {
+      // Sealed segments are read from flash: here, not on the AsyncTCP task
+      std::vector<uint32_t> offsets = indexLookup(id, limit);
+      LogReader log;
+      String line;
+      for (uint32_t off : offsets) {
+        if (!log.readLine(off, line)) return false; // the index points past the log
+        *csv += line + "\r\n";
+      }
+      return true;
+    }, NULL, [csv](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(200, "text/csv; charset=utf-8", *csv);
+      else request->send(500, "text/plain", "Failed to read the log");
+    });
+}
+
+// Typeahead: ?q=<text>[&limit=n] -> [{"id":..,"name":..}], best matches first
+void handleUserSearch(AsyncWebServerRequest *request)
+{
+  String q = request->hasParam("q") ? request->getParam("q")->value() : String();
+  long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : 20;
+  if (limit <= 0 || limit > 100) limit = 100;
+  AsyncResponseStream *res = request->beginResponseStream("application/json");
+  res->print("[");
+  {
+    AccessLock lock;
+    bool first = true;
+    for (const String &id : nameSearch(q, limit)) {
+      auto it = userCache.find(id);
+      if (it == userCache.end()) continue; // stale index entry
+      DynamicJsonDocument item(256);
+      item["id"] = id;
+      item["name"] = it->second.name;
+      if (!first) res->print(",");
+      serializeJson(item, *res);
+      first = false;
+    }
+  }
+  res->print("]");
+  request->send(res);
+}
+
+// All users in sorted order: ?offset=&limit= (default 0, 100)
+// -> {"total":n,"users":[{"id":..,"name":..,"cards":[..]}]}
+void handleUserList(AsyncWebServerRequest *request)
+{
+  long offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+  long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : 100;
+  if (offset < 0) offset = 0;
+  if (limit <= 0 || limit > 500) limit = 500;
+  AsyncResponseStream *res = request->beginResponseStream("application/json");
+  AccessLock lock;
+  res->printf("{\"total\":%u,\"users\":[", (unsigned)userOrder.size());
+  for (size_t i = offset; i < userOrder.size() && i < (size_t)(offset + limit); ++i) {
+    DynamicJsonDocument item(512);
+    item["id"] = userOrder[i]->first;
+    item["name"] = userOrder[i]->second.name;
+    JsonArray cards = item.createNestedArray("cards");
+    for (const String &c : userOrder[i]->second.cards) cards.add(c);
+    if (userOrder[i]->second.expires) item["expires"] = userOrder[i]->second.expires;
+    if (i > (size_t)offset) res->print(",");
+    serializeJson(item, *res);
+  }
+  res->print("]}");
+  request->send(res);
+}
+
+// All users as CSV in sorted order. Streamed in chunks; each chunk resumes
+// after the last user sent, so edits in between never repeat or skip anyone.
+void handleUserExport(AsyncWebServerRequest *request)
+{
+  struct Cursor {
+    String key, id; // last user sent
+    bool started;
+  };
+  std::shared_ptr<Cursor> cur(new Cursor{String(), String(), false});
+  request->send(request->beginChunkedResponse("text/csv; charset=utf-8", [cur](uint8_t *buf, size_t maxLen, size_t) -> size_t {
+    if (memLevel >= MEM_LOW) return RESPONSE_TRY_AGAIN; // paused until memory recovers
+    String out;
+    if (!cur->started) out = "\xEF\xBB\xBF" "id,name,cards\r\n";
+    AccessLock lock;
+    auto it = userOrder.begin();
+    if (cur->started) {
+      it = std::upper_bound(userOrder.begin(), userOrder.end(), cur, [](const std::shared_ptr<Cursor> &c, const UserRef &u) {
+        int r = strcmp(c->key.c_str(), u->second.sortKey.c_str());
+        return r < 0 || (r == 0 && strcmp(c->id.c_str(), u->first.c_str()) < 0);
+      });
+    }
+    cur->started = true;
+    for (; it != userOrder.end(); ++it) {
+      String cards;
+      for (const String &c : (*it)->second.cards) cards += (cards.length() ? " " : "") + c;
+      String row = csvEsc((*it)->first) + "," + csvEsc((*it)->second.name) + "," + csvEsc(cards) + "\r\n";
+      if (out.length() + row.length() > maxLen) break;
+      out += row;
+      cur->key = (*it)->second.sortKey;
+      cur->id = (*it)->first;
+    }
+    memcpy(buf, out.c_str(), out.length());
+    return out.length();
+  }));
+}
+
+// Websockets: send to every client. Under memory pressure a push is dropped
+// rather than queued behind a client that is not keeping up.
+void wsPush(const String &msg)
+{
+  if (memLevel >= MEM_TIGHT && !ws.availableForWriteAll()) {
+    wsPushesDropped++;
     return;
   }
-  userCache[uid] = name;
-  request->send(200, "text/plain", "User saved");
-  Serial.println("[WEB] Added user: " + uid + " -> " + name);
+  ws.textAll(msg);
 }
 
-// Websockets: broadcast scan event
-void broadcastScan(const String &uid, const String &name, const String &result)
+// Websockets: push zone totals after a change
+void broadcastOccupancy()
 {
-  DynamicJsonDocument root(256);
-  root["timestamp"] = nowTimestamp();
-  root["uid"] = uid;
-  root["name"] = name;
+  String out = "{\"type\":\"occupancy\",\"zones\":[";
+  for (uint8_t z = 0; z < MAX_ZONES; ++z) {
+    if (z) out += ",";
+    out += String(zoneOccupancy[z]);
+  }
+  out += "]}";
+  wsPush(out);
+}
+
+// Websockets: broadcast scan event (without device, hlc, timestamp and name
+// when memory is tight)
+void broadcastScan(uint32_t seq, uint64_t hlc, const String &card, const String &id, const String &name, const String &result)
+{
+  DynamicJsonDocument root(384);
+  bool verbose = memLevel < MEM_TIGHT;
+  root["type"] = "scan";
+  if (verbose) root["device"] = deviceId;
+  root["seq"] = seq;
+  if (verbose) root["hlc"] = hlcToString(hlc);
+  if (verbose) root["timestamp"] = nowTimestamp();
+  root["card"] = card;
+  root["user"] = id;
+  if (verbose) root["name"] = name;
   root["result"] = result;
   String out;
   serializeJson(root, out);
-  ws.textAll(out);
+  wsPush(out);
 }
 
 // ------------------ RFID HANDLING ------------------
@@ -306,23 +4833,260 @@ void feedbackFail() {
   }
 }
 
-// Process a scanned UID
-void processUID(const String &uid)
-{
-  String name = "(unknown)";
-  String result = "denied";
-  auto it = userCache.find(uid);
-  if (it != userCache.end()) {
-    name = it->second;
-    result = "accepted";
-    feedbackOK();
-  } else {
-    feedbackFail();
+// Pipeline policies for this firmware (see SCAN PIPELINE)
+
+// MFRC522 on the SPI bus
+struct Mfrc522Reader {
+  bool poll(String &card)
+  {
+    if (!mfrc522.PICC_IsNewCardPresent() || !mfrc522.PICC_ReadCardSerial()) return false;
+    card = uidFromMfrc(mfrc522.uid);
+    mfrc522.PICC_HaltA();
+    return true;
+  }
+};
+
+// Decides from userCache. A granted scan also moves the user's presence and
+// counts in the daily summary.
+struct CacheUserIndex {
+  void decide(ScanEvent &e)
+  {
+    AccessLock lock;
+    bool revoked = cardRevoked(e.card);
+    UserRef it = revoked ? userCache.end() : cardOwner(e.card);
+    if (revoked) {
+      e.result = "revoked";
+      revokedDenials++;
+    } else if (it != userCache.end()) {
+      UserRecord &u = it->second;
+      e.id = it->first;
+      e.name = u.name;
+      if (u.expires && (uint32_t)wallNow() >= u.expires) {
+        e.result = "pass expired"; // the wheel has not caught up yet
+      } else if (!(u.doors & DOOR_BIT)) {
+        e.result = "no access to this door";
+        doorDenials++;
+      } else if (!scheduleAllows(u.access)) {
+        e.result = "outside schedule";
+        scheduleDenials++;
+      } else if (ANTI_PASSBACK != APB_OFF && !passbackOk(u)) {
+        passbackViolations++;
+        e.granted = ANTI_PASSBACK == APB_SOFT;
+        e.result = e.granted ? "accepted (passback)" : "anti-passback";
+      } else {
+        e.granted = true;
+        e.result = "accepted";
+      }
+      if (e.granted) {
+        uint8_t before = u.presence;
+        uint32_t since = u.presenceSince;
+        presenceMove(e.id, u);
+        dailyRecord(e.id, u, before, since);
+      }
+    }
+  }
+};
+
+struct BuzzerLedFeedback {
+  void signal(const ScanEvent &e)
+  {
+    if (e.granted) feedbackOK();
+    else feedbackFail();
+  }
+};
+
+// Numbers the event and appends it to the flash log; runs first
+struct FlashLogSink {
+  void record(ScanEvent &e)
+  {
+    uint32_t off;
+    {
+      // One step for loop(), which marks everything below seqNext durable
+      // once the buffer is empty
+      LogLock lock;
+      e.hlc = hlcNow();
+      e.seq = nextSeq();
+      e.line = attendanceRecord(e.seq, e.hlc, e.card, e.id, e.name, "rfid");
+      off = logAttendance(e.line);
+    }
+    e.logged = off != LOG_APPEND_FAILED;
+    if (e.logged && e.id.length()) indexAdd(e.id, off);
+  }
+};
+
+#if ENABLE_SD
+// Hands the record to the SD mirror task; never waits for the card. A
+// record the flash log refused is not mirrored either.
+struct SdMirrorSink {
+  void record(ScanEvent &e)
+  {
+    if (e.logged) sdMirrorEnqueue(e.seq, e.line);
+  }
+};
+#endif
+
+struct WebSocketSink {
+  void record(ScanEvent &e)
+  {
+    broadcastScan(e.seq, e.hlc, e.card, e.id, e.name, e.result);
+    if (occupancyChanged) {
+      occupancyChanged = false;
+      broadcastOccupancy();
+    }
   }
-  logAttendance(uid, name, "rfid");
-  broadcastScan(uid, name, result);
+};
+
+struct SerialSink {
   // Print UTF-8 name to Serial (Serial monitor must be UTF-8 aware)
-  Serial.printf("Scan: %s -> %s (%s)\n", uid.c_str(), name.c_str(), result.c_str());
+  void record(ScanEvent &e) { Serial.printf("Scan: %s -> %s (%s)\n", e.card.c_str(), e.name.c_str(), e.result.c_str()); }
+};
+
+typedef ScanPipeline<ScanEvent, Mfrc522Reader, CacheUserIndex, TimedFeedback<BuzzerLedFeedback, &scanLatency>, FlashLogSink,
+#if ENABLE_SD
+                     SdMirrorSink,
+#endif
+                     WebSocketSink, SerialSink> DoorPipeline;
+DoorPipeline scanPipeline;
+
+#if ENABLE_PIPELINE_BENCH
+// Times the compile-time pipeline against the same stages behind virtual
+// interfaces chosen at run time, once with the real user index and once
+// with a trivial one (dispatch cost alone). The reader replays a card that
+// is not enrolled, so no user changes; feedback and sinks only count.
+const int BENCH_SCANS = 2000;
+const char *BENCH_CARD = "00BE0C4A";
+
+struct ReplayReader {
+  bool poll(String &card) { card = BENCH_CARD; return true; }
+};
+struct FixedIndex {
+  void decide(ScanEvent &e) { e.granted = true; e.result = "accepted"; }
+};
+struct CountingFeedback {
+  uint32_t n = 0;
+  void signal(const ScanEvent &e) { n += e.granted; }
+};
+struct CountingSink {
+  uint32_t n = 0;
+  void record(ScanEvent &e) { n += e.card.length(); }
+};
+
+// ns per scan
+template <class Pipeline>
+__attribute__((noinline)) float benchPipeline(Pipeline &p)
+{
+  unsigned long t0 = micros();
+  for (int i = 0; i < BENCH_SCANS; ++i) p.poll();
+  return (micros() - t0) * 1000.0f / BENCH_SCANS;
+}
+
+void runPipelineBench()
+{
+  ScanPipeline<ScanEvent, ReplayReader, CacheUserIndex, CountingFeedback, CountingSink, CountingSink, CountingSink> staticCache;
+  ScanPipeline<ScanEvent, ReplayReader, FixedIndex, CountingFeedback, CountingSink, CountingSink, CountingSink> staticFixed;
+  DynReaderOf<ScanEvent, ReplayReader> reader;
+  DynIndexOf<ScanEvent, CacheUserIndex> cache;
+  DynIndexOf<ScanEvent, FixedIndex> fixed;
+  DynFeedbackOf<ScanEvent, CountingFeedback> feedback;
+  DynSinkOf<ScanEvent, CountingSink> sinks[3];
+  DynamicPipeline<ScanEvent> dynamic;
+  dynamic.reader.impl = &reader;
+  dynamic.feedback.impl = &feedback;
+  for (DynSinkOf<ScanEvent, CountingSink> &s : sinks) dynamic.sinks.first.impl.push_back(&s);
+
+  float s = benchPipeline(staticCache);
+  dynamic.index.impl = &cache;
+  float d = benchPipeline(dynamic);
+  Serial.printf("[BENCH] pipeline, user index: static %.0f ns/scan, dynamic %.0f ns/scan\n", s, d);
+  s = benchPipeline(staticFixed);
+  dynamic.index.impl = &fixed;
+  d = benchPipeline(dynamic);
+  Serial.printf("[BENCH] pipeline, fixed index: static %.0f ns/scan, dynamic %.0f ns/scan\n", s, d);
+}
+#endif
+
+// ------------------ TASKS ------------------
+// The reader and the scan pipeline run on their own task (SCAN_TASK), so a
+// scan never waits behind loop()'s maintenance jobs or the web server.
+
+TaskHandle_t scanTaskHandle = NULL;
+
+#if ENABLE_JITTER_PROBE
+// A high-resolution timer stands in for a card arriving: it stamps the due
+// time and wakes the scan task, which runs the probe through the real user
+// index. The latency covers waking the task, lock waits and the decision.
+const char *PROBE_CARD = "00BE0C4A"; // must not be enrolled
+
+struct NoReader {
+  bool poll(String &) { return false; }
+};
+struct NoFeedback {
+  void signal(const ScanEvent &) {}
+};
+ScanPipeline<ScanEvent, NoReader, CacheUserIndex, TimedFeedback<NoFeedback, &probeLatency>> probePipeline;
+volatile int64_t probeDueUs = 0;
+
+void probeTimer(void *)
+{
+  probeDueUs = esp_timer_get_time();
+  xTaskNotifyGive(scanTaskHandle);
+}
+
+void startJitterProbe()
+{
+  esp_timer_create_args_t args = {};
+  args.callback = probeTimer;
+  args.name = "jitter-probe";
+  esp_timer_handle_t timer;
+  if (esp_timer_create(&args, &timer) != ESP_OK || esp_timer_start_periodic(timer, JITTER_PROBE_MS * 1000ULL) != ESP_OK) {
+    Serial.println("[ERR] Cannot start jitter probe");
+  }
+}
+#endif
+
+void scanTask(void *)
+{
+  for (;;) {
+    if (scanPipeline.poll()) vTaskDelay(pdMS_TO_TICKS(300)); // debounce
+#if ENABLE_JITTER_PROBE
+    int64_t due = probeDueUs;
+    if (due) {
+      probeDueUs = 0;
+      probePipeline.process(PROBE_CARD, (uint32_t)due);
+    }
+#endif
+    // Until the next reader poll, or a probe
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RFID_POLL_MS));
+  }
+}
+
+// Place the tasks the Arduino core and AsyncTCP created. Priorities can be
+// changed here; cores only at build time, so those are just checked.
+// Call after server.begin(), which starts the async_tcp task.
+void placeTasks()
+{
+  vTaskPrioritySet(NULL, LOOP_TASK.priority);
+  if (LOOP_TASK.core >= 0 && xPortGetCoreID() != LOOP_TASK.core) {
+    Serial.printf("[TASK] loop() runs on core %d, not %d (ARDUINO_RUNNING_CORE)\n", (int)xPortGetCoreID(), LOOP_TASK.core);
+  }
+  TaskHandle_t tcp = xTaskGetHandle("async_tcp");
+  if (!tcp) {
+    Serial.println("[TASK] async_tcp task not found");
+    return;
+  }
+  vTaskPrioritySet(tcp, ASYNC_TCP_TASK.priority);
+  BaseType_t core = xTaskGetAffinity(tcp);
+  if (ASYNC_TCP_TASK.core >= 0 && core != ASYNC_TCP_TASK.core) {
+    Serial.printf("[TASK] async_tcp runs on core %d, build with -DCONFIG_ASYNC_TCP_RUNNING_CORE=%d\n", (int)core, ASYNC_TCP_TASK.core);
+  }
+}
+
+// Print the scan-to-feedback distribution
+void latencyReport(const char *what, const LatencyHistogram &h)
+{
+  if (!h.n) return;
+  Serial.printf("[LATENCY] %s: n=%u mean=%u p50<=%u p99<=%u max=%u us\n", what, (unsigned)h.n,
+                (unsigned)(h.sumUs / h.n), (unsigned)h.percentile(0.5f), (unsigned)h.percentile(0.99f), (unsigned)h.maxUs);
 }
 
 // ------------------ SETUP ------------------
@@ -331,14 +5095,31 @@ void setup()
 {
   Serial.begin(115200);
   delay(1000);
+  accessMutex = xSemaphoreCreateRecursiveMutex();
+  logMutex = xSemaphoreCreateRecursiveMutex();
+  seqMutex = xSemaphoreCreateMutex();
+  schedStatsMutex = xSemaphoreCreateMutex();
   pinMode(BUZZER_PIN, OUTPUT);
   pinMode(LED_PIN, OUTPUT);
 
-  ensureSPIFFS();
-  ensureAttendanceCSV();
+  ensureStorage();
+#if ENABLE_STORAGE_BENCH
+  runStorageBench(storage, storageBenchIo);
+#if STORAGE_BACKEND != STORAGE_SPIFFS
+  runStorageBench(benchPeer, storageBenchIo);
+#endif
+#endif
+  clockBegin();
+  logKeyBegin();
+  indexBegin(logWriterBegin());
+  chainBegin();
+#if ENABLE_LOG_CRYPTO_BENCH
+  runLogCryptoBench();
+#endif
+  revocationBegin();
 
-#ifdef ENABLE_SD
-  if (!SD.begin()) Serial.println("[WARN] SD card not initialized");
+#if ENABLE_SD
+  startSdMirror();
 #endif
 
   // init rfid
@@ -348,6 +5129,11 @@ void setup()
 
   // load users
   loadUsers();
+  presenceRestore();
+  dailyBegin();
+#if ENABLE_PIPELINE_BENCH
+  runPipelineBench();
+#endif
 
   // Connect WiFi
   WiFi.mode(WIFI_STA);
@@ -360,6 +5146,7 @@ void setup()
   if (WiFi.status() == WL_CONNECTED) {
     Serial.println();
     Serial.print("[WIFI] Connected: "); Serial.println(WiFi.localIP());
+    clockStartSntp();
   } else {
     Serial.println();
     Serial.println("[WIFI] Failed to connect - starting AP mode");
@@ -367,37 +5154,146 @@ void setup()
     Serial.print("[AP] "); Serial.println(WiFi.softAPIP());
   }
 
+#if ENABLE_AUTH
+  authBegin();
+#endif
+  startStorageWorker();
+
   // Setup websocket
-  ws.onEvent([](AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len){
-    // no-op for demo
+  ws.onEvent([](AsyncWebSocket *, AsyncWebSocketClient *client, AwsEventType type, void *, uint8_t *, size_t){
+    // Clients only listen; connects and messages are rate limited per IP
+    if ((type == WS_EVT_CONNECT && !rateAllow(client->remoteIP(), RATE_WS_CONNECT)) ||
+        (type == WS_EVT_DATA && !rateAllow(client->remoteIP(), RATE_WS_MESSAGE))) {
+      client->close(1008, "rate limited");
+    }
   });
+  server.addHandler(&memoryGate); // before everything else
+#if ENABLE_AUTH
+  server.addHandler(&authGate);
+#endif
   server.addHandler(&ws);
 
   // HTTP routes
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){ request->send_P(200, "text/html", index_html); });
-  server.on("/adduser", HTTP_POST, [](AsyncWebServerRequest *request){}, NULL, handleAddUser);
+  server.on("/adduser", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_PROVISION, admittedBody(ADMIT_NORMAL, handleAddUser)));
+#if ENABLE_AUTH
+  server.on("/api/auth/token", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_LOGIN, handleLogin));
+  server.on("/api/auth/rotate", HTTP_POST, limited(RATE_PROVISION, [](AsyncWebServerRequest *request){
+    authNewSecret();
+    request->send(200, "text/plain", "Token key replaced, all tokens revoked");
+  }));
+#endif
+  server.on("/api/metrics", HTTP_GET, limited(RATE_QUERY, handleMetrics));
+  server.on("/api/hlc", HTTP_GET, limited(RATE_SYNC, [](AsyncWebServerRequest *request){
+    request->send(200, "application/json", "{\"device\":\"" + deviceId + "\",\"hlc\":\"" + hlcToString(hlcNow()) + "\"}");
+  }));
+  server.on("/api/hlc", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_SYNC, handleHlc));
+  server.on("/api/access", HTTP_GET, limited(RATE_DOWNLOAD, admitted(ADMIT_BACKGROUND, [](AsyncWebServerRequest *request){
+    std::shared_ptr<String> body(new String());
+    storageSubmit(request, [body]() { *body = readWholeFile(ACCESS_FILE); return true; }, NULL,
+                  [body](AsyncWebServerRequest *request, bool) { request->send(200, "application/json", *body); });
+  })));
+  server.on("/api/access", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_PROVISION, admittedBody(ADMIT_NORMAL, handleAccessUpload)));
+  server.on("/api/groups", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_PROVISION, admittedBody(ADMIT_NORMAL, handleGroupUpdate)));
+  server.on("/api/occupancy", HTTP_GET, limited(RATE_QUERY, admitted(ADMIT_CRITICAL, handleOccupancy)));
+  server.on("/api/reports/daily", HTTP_GET, limited(RATE_DOWNLOAD, admitted(ADMIT_BACKGROUND, handleDailyReport)));
+  server.on("/api/users/history", HTTP_GET, limited(RATE_DOWNLOAD, admitted(ADMIT_BACKGROUND, handleUserHistory)));
+  server.on("/api/users/search", HTTP_GET, limited(RATE_QUERY, admitted(ADMIT_BACKGROUND, handleUserSearch)));
+  server.on("/api/users", HTTP_GET, limited(RATE_QUERY, admitted(ADMIT_BACKGROUND, handleUserList)));
+  server.on("/api/users/export", HTTP_GET, limited(RATE_DOWNLOAD, admitted(ADMIT_BACKGROUND, handleUserExport)));
+  server.on("/api/cards", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_PROVISION, admittedBody(ADMIT_NORMAL, handleCardAdd)));
+  server.on("/api/cards", HTTP_DELETE, limited(RATE_PROVISION, admitted(ADMIT_NORMAL, handleCardRemove)));
+  server.on("/api/revocations", HTTP_GET, limited(RATE_SYNC, [](AsyncWebServerRequest *request){
+    AccessLock lock;
+    request->send(200, "application/json", "{\"version\":" + String(revocationVersion) + ",\"count\":" +
+                  String((unsigned)revokedCards.size()) + "}");
+  }));
+  server.on("/api/revocations", HTTP_POST, [](AsyncWebServerRequest *){}, NULL, limitedBody(RATE_SYNC, admittedBody(ADMIT_CRITICAL, handleRevocations)));
+  server.on("/api/log/chain", HTTP_GET, limited(RATE_QUERY, admitted(ADMIT_BACKGROUND, [](AsyncWebServerRequest *request){
+    if (chainBroken) {
+      request->send(409, "text/plain", "Log chain broken, nothing is signed (see /api/metrics)");
+      return;
+    }
+    std::shared_ptr<String> body(new String());
+    storageSubmit(request, [body]() { return chainSignedHead(*body); }, NULL, [body](AsyncWebServerRequest *request, bool ok) {
+      if (ok) request->send(200, "application/json", *body);
+      else request->send(500, "text/plain", "Cannot save the chain");
+    });
+  })));
+  server.on("/api/index/rebuild", HTTP_POST, limited(RATE_PROVISION, admitted(ADMIT_NORMAL, [](AsyncWebServerRequest *request){
+    indexRebuildPending = true;
+    request->send(202, "text/plain", "Index rebuild scheduled");
+  })));
+  server.on("/api/occupancy/reset", HTTP_POST, limited(RATE_PROVISION, admitted(ADMIT_NORMAL, [](AsyncWebServerRequest *request){
+    storageSubmit(request, []() { presenceReset(); return true; }, NULL, [](AsyncWebServerRequest *request, bool) {
+      request->send(200, "text/plain", "Occupancy reset");
+    });
+  })));
 
-  // serve SPIFFS files
-  server.serveStatic("/files", SPIFFS, "/");
+  // serve flash files, read through the storage worker
+  server.on("/files/*", HTTP_GET, limited(RATE_DOWNLOAD, admitted(ADMIT_BACKGROUND, [](AsyncWebServerRequest *request){
+    String path = request->url().substring(6);
+    if (path.indexOf("..") >= 0) {
+      request->send(400, "text/plain", "Invalid path");
+      return;
+    }
+    streamFile(request, path, contentTypeFor(path));
+  })));
 
   server.begin();
   Serial.println("[WEB] Server started");
+  placeTasks();
+
+  // Maintenance jobs, run from loop()
+  scheduler.every("clock", 50, 5, clockTick);
+  scheduler.every("log-flush", 100, 4, logWriterPoll);
+  scheduler.every("storage-done", 10, 4, storagePoll);
+  scheduler.every("admission", 500, 4, admissionSample);
+  scheduler.every("occupancy-push", 250, 3, [](){
+    if (!occupancyChanged) return;
+    occupancyChanged = false;
+    broadcastOccupancy();
+  });
+  scheduler.every("presence", 200, 3, presencePoll);
+  scheduler.every("passes", 1000, 3, passPoll);
+  scheduler.every("index", 500, 2, indexPoll);
+  scheduler.every("chain-save", CHAIN_SAVE_MS, 1, [](){
+    bool pending;
+    {
+      LogLock lock;
+      pending = !chainPending.empty();
+    }
+    if (pending) storageSubmit(NULL, []() { return chainSave(); }, NULL, NULL);
+  });
+  scheduler.every("daily", 1000, 2, dailyPoll);
+  scheduler.every("access-reload", 500, 2, [](){
+    if (!accessReloadPending) return;
+    accessReloadPending = false;
+    accessReload();
+  });
+  scheduler.every("memory", 250, 4, memoryPoll);
+  scheduler.every("ws-cleanup", 1000, 1, [](){ ws.cleanupClients(MEMORY_LEVELS[memLevel].wsClients); });
+  scheduler.every("sched-report", 10000, 0, schedulerReport);
+  scheduler.every("sched-publish", SCHED_PUBLISH_MS, 0, schedulerPublish);
+  scheduler.after("sntp-check", 60000, 0, [](){
+    if (clockSource != TIME_SNTP) Serial.println("[CLOCK] No SNTP sync yet, timestamps run from the saved clock");
+  });
+
+  // Cards from here on are handled by the scan task
+  startTask(scanTask, "scan", 8192, SCAN_TASK, &scanTaskHandle);
+#if ENABLE_JITTER_PROBE
+  startJitterProbe();
+  scheduler.every("latency-report", 10000, 0, [](){ latencyReport("probe", probeLatency); });
+#endif
 }
 
 // ------------------ MAIN LOOP ------------------
 
 void loop()
 {
-  // RFID loop: if a new card present
-  if (mfrc522.PICC_IsNewCardPresent() && mfrc522.PICC_ReadCardSerial()) {
-    String uid = uidFromMfrc(mfrc522.uid);
-    processUID(uid);
-    mfrc522.PICC_HaltA();
-    delay(300); // debounce
-  }
-
-  // Optional: perform maintenance tasks
-  ws.cleanupClients();
+  // Maintenance only; cards are handled by the scan task. Sleep until the
+  // next job instead of spinning.
+  delay(scheduler.run());
 }
 
 // EOF
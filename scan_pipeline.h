@@ -0,0 +1,125 @@
+// Scan pipeline: a scan flows reader -> user index -> feedback -> sinks.
+// Each stage is a policy class chosen at compile time, so every firmware
+// variant gets a pipeline specialized for its hardware and the compiler can
+// inline the whole path: no virtual calls, no checks for stages a variant
+// lacks. Policies provide:
+//
+//   Reader     bool poll(Card &card)         true if a card was read
+//   UserIndex  void decide(Event &e)         sets id, name, result, granted
+//   Feedback   void signal(const Event &e)
+//   Sink       void record(Event &e)         in order; the log sink numbers
+//                                            the event for the sinks after it
+//
+// Event carries the card (its type is the reader's Card), readUs and a
+// static nowUs() clock. Nothing here touches the hardware, so the pipeline
+// also runs on a host (tests/bench_pipeline.cpp).
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+template <class Event, class... Sinks> struct SinkChain;
+
+template <class Event> struct SinkChain<Event> {
+  void record(Event &) {}
+};
+
+template <class Event, class First, class... Rest> struct SinkChain<Event, First, Rest...> {
+  First first;
+  SinkChain<Event, Rest...> rest;
+  void record(Event &e)
+  {
+    first.record(e);
+    rest.record(e);
+  }
+};
+
+template <class Event, class Reader, class UserIndex, class Feedback, class... Sinks>
+struct ScanPipeline {
+  typedef decltype(Event::card) Card;
+
+  Reader reader;
+  UserIndex index;
+  Feedback feedback;
+  SinkChain<Event, Sinks...> sinks;
+
+  // Process one card if the reader has one
+  bool poll()
+  {
+    Card card;
+    if (!reader.poll(card)) return false;
+    process(card, Event::nowUs());
+    return true;
+  }
+
+  void process(const Card &card, uint32_t readUs)
+  {
+    Event e;
+    e.card = card;
+    e.readUs = readUs;
+    index.decide(e);
+    feedback.signal(e);
+    sinks.record(e);
+  }
+};
+
+// Runtime-polymorphic stages, and policies forwarding to them: ScanPipeline
+// over the Any* policies is the runtime-polymorphic pipeline the benches
+// compare against.
+template <class Event> struct DynReader {
+  virtual ~DynReader() {}
+  virtual bool poll(decltype(Event::card) &card) = 0;
+};
+template <class Event> struct DynIndex {
+  virtual ~DynIndex() {}
+  virtual void decide(Event &e) = 0;
+};
+template <class Event> struct DynFeedback {
+  virtual ~DynFeedback() {}
+  virtual void signal(const Event &e) = 0;
+};
+template <class Event> struct DynSink {
+  virtual ~DynSink() {}
+  virtual void record(Event &e) = 0;
+};
+
+template <class Event, class P> struct DynReaderOf : DynReader<Event> {
+  P p;
+  bool poll(decltype(Event::card) &card) override { return p.poll(card); }
+};
+template <class Event, class P> struct DynIndexOf : DynIndex<Event> {
+  P p;
+  void decide(Event &e) override { p.decide(e); }
+};
+template <class Event, class P> struct DynFeedbackOf : DynFeedback<Event> {
+  P p;
+  void signal(const Event &e) override { p.signal(e); }
+};
+template <class Event, class P> struct DynSinkOf : DynSink<Event> {
+  P p;
+  void record(Event &e) override { p.record(e); }
+};
+
+template <class Event> struct AnyReader {
+  DynReader<Event> *impl;
+  bool poll(decltype(Event::card) &card) { return impl->poll(card); }
+};
+template <class Event> struct AnyIndex {
+  DynIndex<Event> *impl;
+  void decide(Event &e) { impl->decide(e); }
+};
+template <class Event> struct AnyFeedback {
+  DynFeedback<Event> *impl;
+  void signal(const Event &e) { impl->signal(e); }
+};
+template <class Event> struct AnySinks {
+  std::vector<DynSink<Event> *> impl;
+  void record(Event &e)
+  {
+    for (DynSink<Event> *s : impl) s->record(e);
+  }
+};
+
+template <class Event>
+using DynamicPipeline = ScanPipeline<Event, AnyReader<Event>, AnyIndex<Event>, AnyFeedback<Event>, AnySinks<Event>>;
@@ -0,0 +1,116 @@
+// Cooperative scheduler for the maintenance work done from loop(). Jobs are
+// periodic or one-shot; when several are due the highest priority runs
+// first, then the earliest due. Each run has a deadline (the period, or
+// the given deadline for one-shots) and a run that ends past it counts as
+// an overrun. A periodic job that fell behind skips the missed runs instead
+// of running back to back.
+//
+// The clock is passed in and nothing else here touches the hardware, so
+// the class also runs on a host against a virtual clock (tests/).
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+class Scheduler {
+public:
+  typedef uint32_t (*Clock)();
+  typedef std::function<void()> Job;
+
+  struct Task {
+    const char *name;
+    Job fn;
+    uint32_t period;    // 0 = one-shot
+    uint32_t deadline;  // ms after due
+    uint32_t due;
+    uint8_t priority;   // higher runs first
+    int id;
+    uint32_t runs, overruns, skipped;
+    uint32_t maxLateMs, maxRunMs;
+  };
+
+  explicit Scheduler(Clock clock) : clock(clock) {}
+
+  int every(const char *name, uint32_t periodMs, uint8_t priority, Job fn)
+  {
+    return add(name, periodMs, periodMs, clock() + periodMs, priority, fn);
+  }
+
+  int after(const char *name, uint32_t delayMs, uint8_t priority, Job fn, uint32_t deadlineMs = 1000)
+  {
+    return add(name, 0, deadlineMs, clock() + delayMs, priority, fn);
+  }
+
+  void cancel(int id)
+  {
+    for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+      if (it->id == id) {
+        tasks.erase(it);
+        return;
+      }
+    }
+  }
+
+  // Run every job that is due; returns ms until the next one is
+  uint32_t run()
+  {
+    for (;;) {
+      uint32_t now = clock();
+      Task *next = NULL;
+      for (Task &t : tasks) {
+        if ((int32_t)(now - t.due) < 0) continue;
+        if (!next || t.priority > next->priority || (t.priority == next->priority && (int32_t)(t.due - next->due) < 0)) next = &t;
+      }
+      if (!next) break;
+      int id = next->id;
+      uint32_t due = next->due;
+      Job fn = next->fn; // the job may add or cancel tasks
+      fn();
+      uint32_t end = clock();
+      Task *t = find(id);
+      if (!t) continue;
+      t->runs++;
+      t->maxLateMs = std::max(t->maxLateMs, now - due);
+      t->maxRunMs = std::max(t->maxRunMs, end - now);
+      if (end - due > t->deadline) t->overruns++;
+      if (!t->period) {
+        cancel(id);
+        continue;
+      }
+      t->due = due + t->period;
+      if ((int32_t)(end - t->due) >= 0) {
+        uint32_t missed = (end - t->due) / t->period + 1;
+        t->skipped += missed;
+        t->due += missed * t->period;
+      }
+    }
+    uint32_t now = clock(), wait = UINT32_MAX;
+    for (Task &t : tasks) wait = std::min(wait, (int32_t)(t.due - now) > 0 ? t.due - now : 0);
+    return wait;
+  }
+
+  const std::vector<Task> &list() const { return tasks; }
+
+private:
+  int add(const char *name, uint32_t period, uint32_t deadline, uint32_t due, uint8_t priority, Job fn)
+  {
+    Task t = {name, fn, period, deadline, due, priority, ++lastId, 0, 0, 0, 0, 0};
+    tasks.push_back(t);
+    return t.id;
+  }
+
+  Task *find(int id)
+  {
+    for (Task &t : tasks) {
+      if (t.id == id) return &t;
+    }
+    return NULL;
+  }
+
+  Clock clock;
+  std::vector<Task> tasks;
+  int lastId = 0;
+};
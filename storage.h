@@ -0,0 +1,192 @@
+// Flash storage interface, its POSIX implementation and the storage bench.
+// All flash persistence goes through Storage so the filesystem can be
+// swapped at build time without touching the callers. Paths are absolute
+// within the backend ("/users/x.json").
+//
+// Nothing here uses Arduino types: the Arduino fs::FS backends stay in the
+// sketch, and PosixStorage and the bench also run on a host against a
+// temporary directory (tests/bench_storage.cpp).
+
+#pragma once
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <functional>
+#include <memory>
+#include <string>
+
+class StorageReader {
+public:
+  virtual ~StorageReader() {}
+  virtual size_t read(uint8_t *buf, size_t len) = 0;
+  virtual bool seek(uint32_t pos) = 0;
+  virtual size_t size() = 0;
+};
+
+class Storage {
+public:
+  virtual ~Storage() {}
+  virtual const char *name() const = 0;
+  virtual bool begin() = 0;
+  virtual bool exists(const char *path) = 0;
+  virtual bool mkdir(const char *path) = 0;
+  virtual bool remove(const char *path) = 0;
+  virtual bool rename(const char *from, const char *to) = 0;
+  // Create or truncate path and write data
+  virtual bool writeFile(const char *path, const uint8_t *data, size_t len) = 0;
+  virtual bool append(const char *path, const uint8_t *data, size_t len) = 0;
+  // NULL if the file cannot be opened
+  virtual std::unique_ptr<StorageReader> openRead(const char *path) = 0;
+  // Calls fn(path, size) for every file directly inside dir
+  virtual void list(const char *dir, std::function<void(const char *, size_t)> fn) = 0;
+  virtual size_t totalBytes() = 0;
+  virtual size_t usedBytes() = 0;
+};
+
+class PosixReader : public StorageReader {
+public:
+  explicit PosixReader(FILE *fp) : fp(fp) {}
+  ~PosixReader() { fclose(fp); }
+  size_t read(uint8_t *buf, size_t len) override { return fread(buf, 1, len, fp); }
+  bool seek(uint32_t pos) override { return fseek(fp, pos, SEEK_SET) == 0; }
+  size_t size() override
+  {
+    long cur = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long end = ftell(fp);
+    fseek(fp, cur, SEEK_SET);
+    return end < 0 ? 0 : end;
+  }
+private:
+  FILE *fp;
+};
+
+// Mounting and usage figures for PosixStorage, the only parts that differ
+// between the ESP32 (the LittleFS VFS mount) and a host
+struct PosixVolume {
+  bool (*mount)(const char *base);
+  size_t (*totalBytes)(const char *base);
+  size_t (*usedBytes)(const char *base);
+};
+
+// Plain stdio/dirent under a base directory: on the ESP32 the VFS mount point
+// of LittleFS, on a host any directory
+class PosixStorage : public Storage {
+public:
+  PosixStorage(const char *base, const PosixVolume &volume) : base(base), volume(volume) {}
+  const char *name() const override { return "posix"; }
+  bool begin() override { return volume.mount(base); }
+  bool exists(const char *path) override { struct stat st; return stat(full(path).c_str(), &st) == 0; }
+  bool mkdir(const char *path) override { return ::mkdir(full(path).c_str(), 0755) == 0 || exists(path); }
+  bool remove(const char *path) override { return ::remove(full(path).c_str()) == 0; }
+  bool rename(const char *from, const char *to) override { return ::rename(full(from).c_str(), full(to).c_str()) == 0; }
+  bool writeFile(const char *path, const uint8_t *data, size_t len) override { return put(path, "wb", data, len); }
+  bool append(const char *path, const uint8_t *data, size_t len) override { return put(path, "ab", data, len); }
+  std::unique_ptr<StorageReader> openRead(const char *path) override
+  {
+    FILE *fp = fopen(full(path).c_str(), "rb");
+    if (!fp) return nullptr;
+    return std::unique_ptr<StorageReader>(new PosixReader(fp));
+  }
+  void list(const char *dir, std::function<void(const char *, size_t)> fn) override
+  {
+    DIR *d = opendir(full(dir).c_str());
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      std::string path = std::string(dir) + "/" + e->d_name;
+      struct stat st;
+      if (stat(full(path.c_str()).c_str(), &st) == 0 && S_ISREG(st.st_mode)) fn(path.c_str(), st.st_size);
+    }
+    closedir(d);
+  }
+  size_t totalBytes() override { return volume.totalBytes(base); }
+  size_t usedBytes() override { return volume.usedBytes(base); }
+private:
+  std::string full(const char *path) const { return std::string(base) + path; }
+  bool put(const char *path, const char *mode, const uint8_t *data, size_t len)
+  {
+    FILE *fp = fopen(full(path).c_str(), mode);
+    if (!fp) return false;
+    bool ok = fwrite(data, 1, len, fp) == len;
+    return fclose(fp) == 0 && ok;
+  }
+  const char *base;
+  const PosixVolume &volume;
+};
+
+// ------------------ STORAGE BENCH ------------------
+// Measures a backend: append throughput with a typical ~70 byte attendance
+// record, open latency of an existing file, and how append throughput
+// degrades as the volume fills up. The clock (microseconds) and the output
+// (one line per call) are passed in. Writes and removes /bench*.
+const size_t BENCH_RECORD_LEN = 70;
+const int BENCH_APPENDS = 200;
+const int BENCH_OPENS = 100;
+
+struct StorageBenchIo {
+  uint32_t (*nowUs)();
+  void (*out)(const char *line);
+};
+
+// Returns records per second for n single-record appends to path
+inline float benchAppend(Storage &s, const StorageBenchIo &io, const char *path, int n)
+{
+  uint8_t rec[BENCH_RECORD_LEN];
+  memset(rec, 'x', sizeof(rec));
+  rec[sizeof(rec) - 1] = '\n';
+  uint32_t t0 = io.nowUs();
+  for (int i = 0; i < n; ++i) {
+    if (!s.append(path, rec, sizeof(rec))) return 0;
+  }
+  uint32_t dt = io.nowUs() - t0;
+  return dt ? n * 1e6f / dt : 0;
+}
+
+inline void runStorageBench(Storage &s, const StorageBenchIo &io)
+{
+  char line[96];
+  const char *logPath = "/bench.log";
+  s.remove(logPath);
+  snprintf(line, sizeof(line), "[BENCH] backend=%s total=%u used=%u", s.name(),
+           (unsigned)s.totalBytes(), (unsigned)s.usedBytes());
+  io.out(line);
+
+  float rps = benchAppend(s, io, logPath, BENCH_APPENDS);
+  snprintf(line, sizeof(line), "[BENCH] append: %.1f rec/s, %.1f KiB/s", rps, rps * BENCH_RECORD_LEN / 1024);
+  io.out(line);
+
+  uint32_t t0 = io.nowUs();
+  for (int i = 0; i < BENCH_OPENS; ++i) {
+    std::unique_ptr<StorageReader> r = s.openRead(logPath);
+    if (!r) break;
+  }
+  snprintf(line, sizeof(line), "[BENCH] open+close: %u us avg", (unsigned)((io.nowUs() - t0) / BENCH_OPENS));
+  io.out(line);
+
+  // Fill with 16 KiB filler files and re-measure at each fill level
+  static uint8_t filler[1024];
+  memset(filler, 0xA5, sizeof(filler));
+  const int levels[] = {25, 50, 75, 90};
+  int files = 0;
+  for (int level : levels) {
+    size_t target = s.totalBytes() * level / 100;
+    while (s.usedBytes() < target) {
+      std::string path = "/bench_fill" + std::to_string(files++);
+      bool ok = s.writeFile(path.c_str(), filler, sizeof(filler));
+      for (int k = 1; ok && k < 16; ++k) ok = s.append(path.c_str(), filler, sizeof(filler));
+      if (!ok) break;
+    }
+    s.remove(logPath);
+    rps = benchAppend(s, io, logPath, BENCH_APPENDS);
+    snprintf(line, sizeof(line), "[BENCH] fill %d%%: append %.1f rec/s", level, rps);
+    io.out(line);
+  }
+
+  for (int i = 0; i < files; ++i) s.remove(("/bench_fill" + std::to_string(i)).c_str());
+  s.remove(logPath);
+  io.out("[BENCH] done");
+}
@@ -0,0 +1,102 @@
+// Host bench for ScanPipeline (scan_pipeline.h): the compile-time pipeline
+// against the same stub stages behind virtual interfaces, once with a hash
+// map user index and once with a trivial one (dispatch cost alone).
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+#include "scan_pipeline.h"
+
+static const int BENCH_SCANS = 2000000;
+
+struct BenchEvent {
+  std::string card, id, name, result;
+  bool granted = false;
+  uint32_t readUs = 0;
+  static uint32_t nowUs()
+  {
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+};
+
+// Replays the cards in turn, half of them enrolled
+struct ReplayReader {
+  unsigned i = 0;
+  bool poll(std::string &card)
+  {
+    static const char *cards[] = {"00BE0C4A", "04A1B2C3", "DEADBEEF", "12345678"};
+    card = cards[i++ & 3];
+    return true;
+  }
+};
+
+struct MapUserIndex {
+  std::unordered_map<std::string, std::string> users{{"04A1B2C3", "Zoë"}, {"12345678", "Jürgen"}};
+  void decide(BenchEvent &e)
+  {
+    auto it = users.find(e.card);
+    if (it == users.end()) return;
+    e.id = it->first;
+    e.name = it->second;
+    e.granted = true;
+    e.result = "accepted";
+  }
+};
+
+struct FixedIndex {
+  void decide(BenchEvent &e) { e.granted = true; }
+};
+
+struct CountingFeedback {
+  uint32_t n = 0;
+  void signal(const BenchEvent &e) { n += e.granted; }
+};
+
+struct CountingSink {
+  uint32_t n = 0;
+  void record(BenchEvent &e) { n += e.card.size(); }
+};
+
+// ns per scan
+template <class Pipeline>
+__attribute__((noinline)) static double benchPipeline(Pipeline &p)
+{
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_SCANS; ++i) p.poll();
+  std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - t0;
+  return d.count() / BENCH_SCANS;
+}
+
+int main()
+{
+  ScanPipeline<BenchEvent, ReplayReader, MapUserIndex, CountingFeedback, CountingSink, CountingSink, CountingSink> staticMap;
+  ScanPipeline<BenchEvent, ReplayReader, FixedIndex, CountingFeedback, CountingSink, CountingSink, CountingSink> staticFixed;
+  DynReaderOf<BenchEvent, ReplayReader> reader;
+  DynIndexOf<BenchEvent, MapUserIndex> map;
+  DynIndexOf<BenchEvent, FixedIndex> fixed;
+  DynFeedbackOf<BenchEvent, CountingFeedback> feedback;
+  DynSinkOf<BenchEvent, CountingSink> sinks[3];
+  DynamicPipeline<BenchEvent> dynamic;
+  dynamic.reader.impl = &reader;
+  dynamic.feedback.impl = &feedback;
+  for (DynSinkOf<BenchEvent, CountingSink> &s : sinks) dynamic.sinks.first.impl.push_back(&s);
+
+  double s = benchPipeline(staticMap);
+  dynamic.index.impl = &map;
+  double d = benchPipeline(dynamic);
+  std::printf("pipeline, user index: static %.1f ns/scan, dynamic %.1f ns/scan\n", s, d);
+  s = benchPipeline(staticFixed);
+  dynamic.index.impl = &fixed;
+  d = benchPipeline(dynamic);
+  std::printf("pipeline, fixed index: static %.1f ns/scan, dynamic %.1f ns/scan\n", s, d);
+
+  // Both pipelines saw every scan
+  if (staticMap.feedback.n + staticFixed.feedback.n != feedback.p.n ||
+      staticMap.sinks.first.n + staticFixed.sinks.first.n != sinks[0].p.n) {
+    std::printf("FAIL: static and dynamic pipelines disagree\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Host bench for PosixStorage (storage.h): runs the storage bench in a
+// temporary directory. The volume is a fixed quota the size of the data
+// partition, so the fill levels fill the quota and not the host's disk.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "storage.h"
+
+static const size_t QUOTA_BYTES = 1536 * 1024;
+
+// Bytes in the files directly inside base, like the bench's own files
+static size_t dirBytes(const char *base)
+{
+  size_t used = 0;
+  DIR *d = opendir(base);
+  if (!d) return 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    std::string path = std::string(base) + "/" + e->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) used += st.st_size;
+  }
+  closedir(d);
+  return used;
+}
+
+static const PosixVolume quotaVolume = {
+  [](const char *base) { struct stat st; return stat(base, &st) == 0 && S_ISDIR(st.st_mode); },
+  [](const char *) { return QUOTA_BYTES; },
+  [](const char *base) { return dirBytes(base); },
+};
+
+static uint32_t nowUs()
+{
+  using namespace std::chrono;
+  return (uint32_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void out(const char *line) { std::printf("%s\n", line); }
+
+int main()
+{
+  char base[] = "/tmp/bench_storage.XXXXXX";
+  if (!mkdtemp(base)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  PosixStorage s(base, quotaVolume);
+  int rc = 0;
+  if (!s.begin()) {
+    std::printf("FAIL: cannot use %s\n", base);
+    rc = 1;
+  } else {
+    runStorageBench(s, {nowUs, out});
+    // The bench removes what it wrote
+    if (s.usedBytes() != 0) {
+      std::printf("FAIL: bench left %u bytes in %s\n", (unsigned)s.usedBytes(), base);
+      rc = 1;
+    }
+  }
+  if (rc == 0) rmdir(base);
+  return rc;
+}
@@ -0,0 +1,125 @@
+// Host test for Scheduler (scheduler.h) against a virtual clock
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+#include "scheduler.h"
+
+static uint32_t fakeNow = 0;
+static uint32_t fakeClock() { return fakeNow; }
+
+static const Scheduler::Task &task(const Scheduler &s, int id)
+{
+  for (const Scheduler::Task &t : s.list()) {
+    if (t.id == id) return t;
+  }
+  assert(!"no such task");
+  return s.list()[0];
+}
+
+// Due together: higher priority first, then the earliest due
+static void runsByPriorityThenDue()
+{
+  fakeNow = 1000;
+  Scheduler s(fakeClock);
+  std::string order;
+  s.every("low", 100, 0, [&]() { order += "L"; });
+  s.after("early", 50, 1, [&]() { order += "E"; });
+  s.every("high", 100, 5, [&]() { order += "H"; });
+  s.every("mid", 90, 1, [&]() { order += "M"; });
+  fakeNow = 1100;
+  s.run();
+  assert(order == "HEML");
+}
+
+// Nothing runs before it is due; run() reports the wait until the next job
+static void waitsUntilDue()
+{
+  fakeNow = 0;
+  Scheduler s(fakeClock);
+  int runs = 0;
+  s.every("tick", 100, 0, [&]() { runs++; });
+  fakeNow = 99;
+  assert(s.run() == 1 && runs == 0);
+  fakeNow = 100;
+  assert(s.run() == 100 && runs == 1);
+  fakeNow = 150;
+  assert(s.run() == 50 && runs == 1);
+}
+
+// A run ending past its deadline is an overrun, and the missed periods are
+// skipped instead of run back to back
+static void overrunSkipsMissedRuns()
+{
+  fakeNow = 0;
+  Scheduler s(fakeClock);
+  int runs = 0;
+  int id = s.every("slow", 100, 0, [&]() {
+    if (++runs == 1) fakeNow += 350; // first run blocks for 3.5 periods
+  });
+  fakeNow = 100;
+  s.run();
+  const Scheduler::Task &t = task(s, id);
+  assert(runs == 1 && t.runs == 1 && t.overruns == 1);
+  assert(t.skipped == 3 && t.due == 500 && t.maxRunMs == 350);
+  fakeNow = 500;
+  s.run();
+  assert(runs == 2 && task(s, id).overruns == 1 && task(s, id).maxLateMs == 0);
+}
+
+// A job that starts late but finishes within its deadline is not an overrun
+static void lateIsNotOverrun()
+{
+  fakeNow = 0;
+  Scheduler s(fakeClock);
+  int id = s.every("late", 100, 0, []() {});
+  fakeNow = 160;
+  s.run();
+  const Scheduler::Task &t = task(s, id);
+  assert(t.runs == 1 && t.overruns == 0 && t.maxLateMs == 60 && t.due == 200);
+}
+
+// One-shots run once; jobs may cancel themselves or others while running
+static void oneShotAndCancel()
+{
+  fakeNow = 0;
+  Scheduler s(fakeClock);
+  int shots = 0, victimRuns = 0;
+  s.after("once", 10, 0, [&]() { shots++; });
+  int victim = s.every("victim", 20, 0, [&]() { victimRuns++; });
+  s.every("killer", 20, 1, [&]() { s.cancel(victim); });
+  fakeNow = 20;
+  s.run();
+  assert(shots == 1 && victimRuns == 0);
+  assert(s.list().size() == 1);
+  fakeNow = 1000;
+  s.run();
+  assert(shots == 1);
+}
+
+// The clock wraps after 49.7 days; due times compare modulo 2^32
+static void survivesClockWrap()
+{
+  fakeNow = 0xFFFFFF00u;
+  Scheduler s(fakeClock);
+  int runs = 0;
+  s.every("wrap", 0x200, 0, [&]() { runs++; });
+  fakeNow = 0xFFFFFFF0u;
+  s.run();
+  assert(runs == 0);
+  fakeNow = 0x100;
+  s.run();
+  assert(runs == 1);
+}
+
+int main()
+{
+  runsByPriorityThenDue();
+  waitsUntilDue();
+  overrunSkipsMissedRuns();
+  lateIsNotOverrun();
+  oneShotAndCancel();
+  survivesClockWrap();
+  printf("test_scheduler: ok\n");
+  return 0;
+}
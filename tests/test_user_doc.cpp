@@ -0,0 +1,60 @@
+// Host test for mergeUserFields (user_doc.h). Needs ArduinoJson 6, see Makefile.
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "user_doc.h"
+
+static bool eq(JsonVariant v, const char *s) { return strcmp(v | "", s) == 0; }
+
+// The form's "add card" request only carries id, name and uid: the pass
+// must keep its schedule, groups, role and expiry
+static void addCardKeepsRestrictions()
+{
+  DynamicJsonDocument user(1024), req(512);
+  deserializeJson(user, "{\"id\":\"v1\",\"name\":\"Visitor\",\"cards\":[\"04A1\"],\"schedule\":\"office\","
+                        "\"groups\":[\"visitors\"],\"role\":\"guest\",\"expires\":1893456000}");
+  deserializeJson(req, "{\"id\":\"v1\",\"name\":\"Visitor\",\"uid\":\"04B2\"}");
+  mergeUserFields(user, req);
+  assert(eq(user["name"], "Visitor"));
+  assert(eq(user["schedule"], "office"));
+  assert(user["groups"].size() == 1 && eq(user["groups"][0], "visitors"));
+  assert(eq(user["role"], "guest"));
+  assert(user["expires"].as<uint32_t>() == 1893456000u);
+  assert(!user.containsKey("uid"));
+}
+
+// Present fields replace, null removes, wrong types are ignored
+static void fieldsReplaceAndRemove()
+{
+  DynamicJsonDocument user(1024), req(512);
+  deserializeJson(user, "{\"id\":\"u1\",\"name\":\"Anna\",\"schedule\":\"office\",\"role\":\"admin\",\"expires\":5,\"note\":\"x\"}");
+  deserializeJson(req, "{\"name\":\"Anna S\",\"schedule\":\"night\",\"role\":null,\"expires\":\"soon\",\"groups\":[\"staff\"]}");
+  mergeUserFields(user, req);
+  assert(eq(user["name"], "Anna S"));
+  assert(eq(user["schedule"], "night"));
+  assert(!user.containsKey("role"));
+  assert(user["expires"].as<uint32_t>() == 5);
+  assert(eq(user["groups"][0], "staff"));
+  assert(eq(user["note"], "x"));
+}
+
+// A new user starts from an empty document
+static void newUser()
+{
+  DynamicJsonDocument user(1024), req(512);
+  deserializeJson(req, "{\"id\":\"u2\",\"name\":\"Bo\",\"expires\":100}");
+  mergeUserFields(user, req);
+  assert(eq(user["name"], "Bo"));
+  assert(user["expires"].as<uint32_t>() == 100);
+  assert(!user.containsKey("schedule"));
+}
+
+int main()
+{
+  addCardKeepsRestrictions();
+  fieldsReplaceAndRemove();
+  newUser();
+  printf("test_user_doc: ok\n");
+  return 0;
+}
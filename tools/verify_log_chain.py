@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Check a downloaded attendance log against its hash chain.
+
+Download from the device:
+  /files/attendance.csv     the log (decrypted as it is served)
+  /files/attendance.chain   one 36-byte entry per flushed block:
+                            end offset (uint32 little-endian) + SHA-256
+  /api/log/chain            signed chain head (JSON), optional
+
+and run:
+  verify_log_chain.py attendance.csv attendance.chain [--head head.json]
+                      [--public-key HEX]
+
+The log is read once, front to back. Each block's hash is
+SHA-256(previous hash || block bytes), starting from 32 zero bytes. The
+first block whose hash does not match is reported with its byte range.
+Bytes after the last entry were written after the chain was saved and
+are reported as unchained, not as an error.
+
+With --head the head must match the chain entry it names. Checking its
+signature needs the "cryptography" package and the device's public key.
+Pass the key recorded when the device was installed with --public-key.
+The key inside the head only proves the head was not corrupted.
+"""
+import argparse
+import hashlib
+import json
+import struct
+import sys
+
+ENTRY = struct.Struct("<I32s")
+
+
+def entries(path):
+    with open(path, "rb") as f:
+        while True:
+            raw = f.read(ENTRY.size)
+            if len(raw) < ENTRY.size:
+                if raw:
+                    print(f"warning: {len(raw)} stray bytes at the end of the chain file")
+                return
+            yield ENTRY.unpack(raw)
+
+
+def verify_chain(log_path, chain_path):
+    """Returns the (end, hash) of every block, or exits on the first bad one."""
+    prev = bytes(32)
+    chained = []
+    pos = 0
+    with open(log_path, "rb") as log:
+        for end, expected in entries(chain_path):
+            block, start = len(chained), pos
+            if end < start:
+                sys.exit(f"FAIL: chain entry {block} ends at {end}, before its start {start}")
+            h = hashlib.sha256(prev)
+            while pos < end:
+                chunk = log.read(min(end - pos, 65536))
+                if not chunk:
+                    sys.exit(f"FAIL: log ends at {pos}, chain entry {block} expects {end} bytes")
+                h.update(chunk)
+                pos += len(chunk)
+            if h.digest() != expected:
+                sys.exit(f"FAIL: block {block} (bytes {start}..{end}) does not match the chain")
+            chained.append((end, expected))
+            prev = expected
+        tail = sum(len(c) for c in iter(lambda: log.read(65536), b""))
+    print(f"OK: {len(chained)} blocks, {pos} bytes chained")
+    if tail:
+        print(f"note: {tail} bytes after the last chain entry are not covered yet")
+    return chained
+
+
+def verify_head(head_path, chained, public_key):
+    with open(head_path) as f:
+        head = json.load(f)
+    n = head["blocks"]
+    if n > len(chained):
+        sys.exit(f"FAIL: head names {n} blocks, the chain file has {len(chained)}")
+    end, last = chained[n - 1] if n else (0, bytes(32))
+    if head["end"] != end or bytes.fromhex(head["hash"]) != last:
+        sys.exit(f"FAIL: head does not match chain entry {n - 1}")
+    if n < len(chained):
+        print(f"note: head covers {n} of {len(chained)} blocks; fetch it again to cover them all")
+    if not head.get("signature"):
+        sys.exit("FAIL: head is not signed")
+    try:
+        from cryptography.exceptions import InvalidSignature
+        from cryptography.hazmat.primitives import hashes
+        from cryptography.hazmat.primitives.asymmetric import ec
+        from cryptography.hazmat.primitives.asymmetric.utils import encode_dss_signature
+    except ImportError:
+        print("note: install 'cryptography' to check the head's signature")
+        return
+    if public_key is None:
+        print("warning: no --public-key given, checking against the key the head carries")
+        public_key = head["public_key"]
+    key = ec.EllipticCurvePublicKey.from_encoded_point(ec.SECP256R1(), bytes.fromhex(public_key))
+    msg = f"rfid-log-chain:{head['device']}:{head['blocks']}:{head['end']}:{head['hash']}:{head['signed_at']}"
+    sig = bytes.fromhex(head["signature"])
+    der = encode_dss_signature(int.from_bytes(sig[:32], "big"), int.from_bytes(sig[32:], "big"))
+    try:
+        key.verify(der, msg.encode(), ec.ECDSA(hashes.SHA256()))
+    except InvalidSignature:
+        sys.exit("FAIL: bad head signature")
+    print(f"OK: head signed by device {head['device']} at {head['signed_at']}")
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    p.add_argument("log")
+    p.add_argument("chain")
+    p.add_argument("--head", help="JSON from /api/log/chain")
+    p.add_argument("--public-key", help="device public key (hex, uncompressed point)")
+    args = p.parse_args()
+    chained = verify_chain(args.log, args.chain)
+    if args.head:
+        verify_head(args.head, chained, args.public_key)
+
+
+if __name__ == "__main__":
+    main()
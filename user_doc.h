@@ -0,0 +1,29 @@
+// User file merging for the add/update user API. Plain ArduinoJson with no
+// Arduino types, so tests/ can run it on a host.
+#pragma once
+
+#include <ArduinoJson.h>
+
+// Merge the fields of an add/update request over a user's stored file.
+// Fields the request carries replace the stored ones and null removes them.
+// Fields it leaves out are kept, so adding a card to a visitor pass keeps
+// its schedule, groups, role and expiry. Values of the wrong type are
+// ignored. The caller sets "id" and "cards".
+inline void mergeUserFields(JsonDocument &user, JsonDocument &req)
+{
+  struct Field {
+    const char *key;
+    bool valid;
+  } fields[] = {
+    {"name", req["name"].is<const char *>()},
+    {"schedule", req["schedule"].is<const char *>()},
+    {"groups", req["groups"].is<JsonArray>()},
+    {"role", req["role"].is<const char *>()},
+    {"expires", req["expires"].is<uint32_t>()},
+  };
+  for (const Field &f : fields) {
+    if (!req.containsKey(f.key)) continue;
+    if (req[f.key].isNull()) user.remove(f.key);
+    else if (f.valid) user[f.key] = req[f.key];
+  }
+}